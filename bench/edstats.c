@@ -0,0 +1,65 @@
+/*
+ * edstats.c -- print what redrawing the edit line has cost on a tty
+ *
+ * usage: edstats [tty]
+ *
+ * Reads the counters n_tty keeps with TIOCGEDSTATS, from the named tty
+ * or from standard input.  They only go up, so to measure something,
+ * run this before and after and subtract: for example
+ *
+ *	edstats /dev/tty2; (type on tty2); edstats /dev/tty2
+ *
+ * The bytes per edit are what one keystroke in the middle of a line
+ * costs to redraw.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+/* From n_tty.c, until <linux/tty.h> has them. */
+#ifndef TIOCGEDSTATS
+#define TIOCGEDSTATS	0x5475
+
+struct tty_edstats {
+	unsigned long es_echo_bytes;	/* bytes echoed */
+	unsigned long es_edit_count;	/* keystrokes with text after cursor */
+	unsigned long es_edit_bytes;	/* bytes those echoed */
+};
+#endif
+
+int main(int argc, char **argv)
+{
+	struct tty_edstats es;
+	int fd = 0;
+
+	if (argc > 2) {
+		fprintf(stderr, "usage: %s [tty]\n", argv[0]);
+		return 1;
+	}
+	if (argc == 2) {
+		fd = open(argv[1], O_RDONLY | O_NONBLOCK);
+		if (fd < 0) {
+			fprintf(stderr, "%s: %s: %s\n", argv[0], argv[1],
+				strerror(errno));
+			return 1;
+		}
+	}
+	if (ioctl(fd, TIOCGEDSTATS, &es) < 0) {
+		fprintf(stderr, "%s: TIOCGEDSTATS: %s\n", argv[0],
+			strerror(errno));
+		return 1;
+	}
+
+	printf("echoed %lu bytes\n", es.es_echo_bytes);
+	printf("%lu edits took %lu bytes", es.es_edit_count,
+	       es.es_edit_bytes);
+	if (es.es_edit_count)
+		printf(", %.1f per edit",
+		       (double) es.es_edit_bytes / es.es_edit_count);
+	printf("\n");
+	return 0;
+}
@@ -0,0 +1,11 @@
+/*
+ * kstub.c -- the kernel variables kstub.h declares
+ */
+
+#include "kstub.h"
+
+int intr_count;
+unsigned long jiffies;
+
+static struct sig_k cur_sig;
+struct task cur_task = { 0, 0, 0, 0, 0, 0, &cur_sig, 1 };
@@ -0,0 +1,212 @@
+/*
+ * kstub.h -- just enough of the Linux 2.0 kernel headers to compile
+ * n_tty.c as an ordinary program, for the benchmarks in this
+ * directory.  Nothing here sleeps, signals or talks to a device.
+ * The few variables are in kstub.c.
+ */
+
+#ifndef KSTUB_H
+#define KSTUB_H
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#define ENOIOCTLCMD 515
+#define ERESTARTSYS 512
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#undef CTRL
+#undef TIOCSTI
+#define inline inline
+#define N_TTY_BUF_SIZE 4096
+#define HZ 100
+#define TTY_MAJOR 4
+#define MKDEV(a,b) (((a)<<8)|(b))
+#define printk printf
+#define cli() do{}while(0)
+#define sti() do{}while(0)
+#define save_flags(x) ((x)=0)
+#define restore_flags(x) ((void)(x))
+#define GFP_ATOMIC 1
+#define GFP_KERNEL 0
+#define TQUEUE_BH 0
+#define disable_bh(x) do{}while(0)
+#define enable_bh(x) do{}while(0)
+extern int intr_count;
+extern unsigned long jiffies;
+static inline unsigned long get_free_page(int p){(void)p;return (unsigned long)malloc(4096);}
+static inline void free_page(unsigned long a){free((void*)a);}
+#define kmalloc(n,p) malloc(n)
+#define kfree(p) free(p)
+#define kfree_s(p,n) free(p)
+static inline int set_bit(int nr, void *a){unsigned long *p=a; int o=(p[nr/64]>>(nr%64))&1; p[nr/64]|=1UL<<(nr%64); return o;}
+static inline int clear_bit(int nr, void *a){unsigned long *p=a; int o=(p[nr/64]>>(nr%64))&1; p[nr/64]&=~(1UL<<(nr%64)); return o;}
+static inline int test_bit(int nr, const void *a){const unsigned long *p=a; return (p[nr/64]>>(nr%64))&1;}
+static inline unsigned long find_next_zero_bit(void *a, unsigned long size, unsigned long off){for(;off<size;off++) if(!test_bit(off,a)) return off; return size;}
+static inline unsigned long find_first_zero_bit(void *a, unsigned long size){return find_next_zero_bit(a,size,0);}
+static inline unsigned long ffz(unsigned long w){return __builtin_ctzl(~w);}
+#define memcpy_tofs(to,from,n) memcpy(to,from,n)
+#define memcpy_fromfs(to,from,n) memcpy(to,from,n)
+#define put_user(x,p) (*(p)=(x))
+#define get_user(p) (*(p))
+#define put_fs_long(x,p) (*(p)=(x))
+#define get_fs_long(p) (*(p))
+static inline int verify_area(int t, const void *p, unsigned long n){(void)t;(void)p;(void)n;return 0;}
+#define VERIFY_READ 0
+#define VERIFY_WRITE 1
+struct wait_queue { void *task; struct wait_queue *next; };
+struct fasync_struct;
+struct inode { int i_rdev; };
+struct file { struct inode *f_inode; int f_flags; int f_mode; };
+typedef int select_table;
+#define SEL_IN 1
+#define SEL_OUT 2
+#define SEL_EX 4
+struct tty_struct;
+struct tty_driver {
+	int flags;
+	int (*write)(struct tty_struct *, int, const unsigned char *, int);
+	void (*put_char)(struct tty_struct *, unsigned char);
+	void (*flush_chars)(struct tty_struct *);
+	int (*write_room)(struct tty_struct *);
+	int (*chars_in_buffer)(struct tty_struct *);
+	void (*flush_buffer)(struct tty_struct *);
+	void (*throttle)(struct tty_struct *);
+	void (*unthrottle)(struct tty_struct *);
+};
+#define TTY_DRIVER_REAL_RAW 1
+#define TTY_NORMAL 0
+#define TTY_BREAK 1
+#define TTY_FRAME 2
+#define TTY_PARITY 3
+#define TTY_OVERRUN 4
+#define TTY_THROTTLED 0
+#define TTY_PUSH 6
+#define TTY_DO_WRITE_WAKEUP 5
+#define TTY_OTHER_CLOSED 2
+#define TIOCPKT_FLUSHREAD 1
+#define TIOCPKT_DATA 0
+#define __DISABLED_CHAR '\0'
+#undef XTABS
+#define XTABS TAB3
+struct tty_struct {
+	struct termios *termios;
+	struct tty_driver driver;
+	struct tty_struct *link;
+	struct fasync_struct *fasync;
+	struct wait_queue *read_wait, *write_wait;
+	unsigned long flags;
+	int pgrp, session, count, stopped, packet, ctrl_status;
+	void *disc_data;
+	unsigned char closing:1, lnext:1, erasing:1, raw:1, real_raw:1, icanon:1, esc:3, esc_bracket:1, plain_print:1;
+	unsigned short esc_param[2]; unsigned char esc_nparam;
+	unsigned long process_char_map[256/(8*sizeof(unsigned long))];
+	unsigned int column;
+	int minimum_to_wake;
+	unsigned long overrun_time;
+	int num_overrun;
+	unsigned char *read_buf, *echo_buf, *shadow, *read_width; unsigned char opost_map[256], recv_xlat[256]; unsigned short recv_action[256]; struct n_tty_keymap *keymap; struct n_tty_hist *history; int echo_cnt; unsigned int shadow_end; unsigned long echo_bytes, edit_count, edit_bytes;
+	int read_head, read_tail, read_cnt, read_extra, read_extra_end;
+	unsigned long read_flags[N_TTY_BUF_SIZE/(8*sizeof(unsigned long))];
+	int canon_data;
+	unsigned long canon_head;
+	unsigned int canon_column;
+};
+struct tty_ldisc {
+	int magic, num, flags;
+	int (*open)(struct tty_struct *);
+	void (*close)(struct tty_struct *);
+	void (*flush_buffer)(struct tty_struct *);
+	int (*chars_in_buffer)(struct tty_struct *);
+	int (*read)(struct tty_struct *, struct file *, unsigned char *, unsigned int);
+	int (*write)(struct tty_struct *, struct file *, const unsigned char *, unsigned int);
+	int (*ioctl)(struct tty_struct *, struct file *, unsigned int, unsigned long);
+	void (*set_termios)(struct tty_struct *, struct termios *);
+	int (*select)(struct tty_struct *, struct inode *, struct file *, int, select_table *);
+	void (*receive_buf)(struct tty_struct *, const unsigned char *, char *, int);
+	int (*receive_room)(struct tty_struct *);
+	void (*write_wakeup)(struct tty_struct *);
+};
+#define TTY_LDISC_MAGIC 0x5403
+#define ENOIOCTLCMD 515
+#define ERESTARTSYS 512
+struct sigaction_k { void *sa_handler_; };
+struct sig_k { struct sigaction_k action[32]; };
+struct task { int state; unsigned long timeout; unsigned long signal, blocked; int pgrp; struct tty_struct *tty; struct sig_k *sig; int pid; };
+extern struct task cur_task;
+#define current (&cur_task)
+#define TASK_INTERRUPTIBLE 1
+#define TASK_RUNNING 0
+#define SIG_IGN_K ((void*)1)
+static inline void kill_pg(int pg, int sig, int p){(void)pg;(void)sig;(void)p;}
+static inline void kill_fasync(struct fasync_struct *f, int s){(void)f;(void)s;}
+static inline void wake_up_interruptible(struct wait_queue **q){(void)q;}
+static inline void add_wait_queue(struct wait_queue **q, struct wait_queue *w){(void)q;(void)w;}
+static inline void remove_wait_queue(struct wait_queue **q, struct wait_queue *w){(void)q;(void)w;}
+static inline int waitqueue_active(struct wait_queue **q){(void)q;return 0;}
+static inline void select_wait(struct wait_queue **q, select_table *w){(void)q;(void)w;}
+static inline void schedule(void){}
+static inline int is_orphaned_pgrp(int p){(void)p;return 0;}
+static inline int tty_hung_up_p(struct file *f){(void)f;return 0;}
+static inline int tty_check_change(struct tty_struct *t){(void)t;return 0;}
+static inline void start_tty(struct tty_struct *t){t->stopped=0;}
+static inline void stop_tty(struct tty_struct *t){t->stopped=1;}
+static inline char *_tty_name(struct tty_struct *t, char *b){(void)t;strcpy(b,"tty");return b;}
+static inline char *tty_name(struct tty_struct *t){(void)t;return "tty";}
+static inline int n_tty_ioctl(struct tty_struct *t, struct file *f, unsigned int c, unsigned long a){(void)t;(void)f;(void)c;(void)a;return -ENOIOCTLCMD;}
+
+static int is_su=1; static inline int suser(void){return is_su;}
+#define _I_FLAG(tty,f)	((tty)->termios->c_iflag & (f))
+#define _O_FLAG(tty,f)	((tty)->termios->c_oflag & (f))
+#define _C_FLAG(tty,f)	((tty)->termios->c_cflag & (f))
+#define _L_FLAG(tty,f)	((tty)->termios->c_lflag & (f))
+#define I_IGNBRK(tty)	_I_FLAG((tty),IGNBRK)
+#define I_BRKINT(tty)	_I_FLAG((tty),BRKINT)
+#define I_IGNPAR(tty)	_I_FLAG((tty),IGNPAR)
+#define I_PARMRK(tty)	_I_FLAG((tty),PARMRK)
+#define I_INPCK(tty)	_I_FLAG((tty),INPCK)
+#define I_ISTRIP(tty)	_I_FLAG((tty),ISTRIP)
+#define I_INLCR(tty)	_I_FLAG((tty),INLCR)
+#define I_IGNCR(tty)	_I_FLAG((tty),IGNCR)
+#define I_ICRNL(tty)	_I_FLAG((tty),ICRNL)
+#define I_IUCLC(tty)	_I_FLAG((tty),IUCLC)
+#define I_IXON(tty)	_I_FLAG((tty),IXON)
+#define I_IXANY(tty)	_I_FLAG((tty),IXANY)
+#define O_OPOST(tty)	_O_FLAG((tty),OPOST)
+#define O_OLCUC(tty)	_O_FLAG((tty),OLCUC)
+#define O_ONLCR(tty)	_O_FLAG((tty),ONLCR)
+#define O_OCRNL(tty)	_O_FLAG((tty),OCRNL)
+#define O_ONOCR(tty)	_O_FLAG((tty),ONOCR)
+#define O_ONLRET(tty)	_O_FLAG((tty),ONLRET)
+#define O_TABDLY(tty)	_O_FLAG((tty),TABDLY)
+#define L_ISIG(tty)	_L_FLAG((tty),ISIG)
+#define L_ICANON(tty)	_L_FLAG((tty),ICANON)
+#define L_ECHO(tty)	_L_FLAG((tty),ECHO)
+#define L_ECHOE(tty)	_L_FLAG((tty),ECHOE)
+#define L_ECHOK(tty)	_L_FLAG((tty),ECHOK)
+#define L_ECHONL(tty)	_L_FLAG((tty),ECHONL)
+#define L_NOFLSH(tty)	_L_FLAG((tty),NOFLSH)
+#define L_TOSTOP(tty)	_L_FLAG((tty),TOSTOP)
+#define L_ECHOCTL(tty)	_L_FLAG((tty),ECHOCTL)
+#define L_ECHOPRT(tty)	_L_FLAG((tty),ECHOPRT)
+#define L_ECHOKE(tty)	_L_FLAG((tty),ECHOKE)
+#define L_IEXTEN(tty)	_L_FLAG((tty),IEXTEN)
+#define INTR_CHAR(tty) ((tty)->termios->c_cc[VINTR])
+#define QUIT_CHAR(tty) ((tty)->termios->c_cc[VQUIT])
+#define ERASE_CHAR(tty) ((tty)->termios->c_cc[VERASE])
+#define KILL_CHAR(tty) ((tty)->termios->c_cc[VKILL])
+#define EOF_CHAR(tty) ((tty)->termios->c_cc[VEOF])
+#define TIME_CHAR(tty) ((tty)->termios->c_cc[VTIME])
+#define MIN_CHAR(tty) ((tty)->termios->c_cc[VMIN])
+#define START_CHAR(tty) ((tty)->termios->c_cc[VSTART])
+#define STOP_CHAR(tty) ((tty)->termios->c_cc[VSTOP])
+#define SUSP_CHAR(tty) ((tty)->termios->c_cc[VSUSP])
+#define EOL_CHAR(tty) ((tty)->termios->c_cc[VEOL])
+#define REPRINT_CHAR(tty) ((tty)->termios->c_cc[VREPRINT])
+#define WERASE_CHAR(tty) ((tty)->termios->c_cc[VWERASE])
+#define LNEXT_CHAR(tty)	((tty)->termios->c_cc[VLNEXT])
+#define EOL2_CHAR(tty) ((tty)->termios->c_cc[VEOL2])
+#endif
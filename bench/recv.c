@@ -0,0 +1,176 @@
+/*
+ * recv.c -- time the receive path before and after the receive tables
+ *
+ * n_tty_receive_char() used to run a chain of flag tests and control
+ * character comparisons for every byte that was in process_char_map;
+ * now it looks the answer up in recv_xlat and recv_action.  This links
+ * in the n_tty.c from before that change and the current one (see
+ * recvpath.c), feeds each the same byte stream through receive_buf
+ * under a few termios settings, and prints the time per byte.
+ *
+ * The stream goes in 512 bytes at a time, as from a flip buffer, and
+ * what is received is read back out after each piece; only the
+ * receive_buf calls are timed.  The older n_tty.c always has the
+ * emacs keys and never a history, whatever the EMACS and HISTORY
+ * flags say.
+ *
+ * usage: recv [megabytes]
+ */
+
+#include "kstub.h"
+
+#include <time.h>
+
+#define CHUNK 512
+
+/* From n_tty.c. */
+#ifndef EMACS
+#define EMACS	0400000
+#endif
+#ifndef MIN
+#define MIN(a,b)	((a) < (b) ? (a) : (b))
+#endif
+
+extern struct tty_ldisc base_ldisc, tty_ldisc_N_TTY;
+
+static int d_write(struct tty_struct *tty, int from_user,
+		   const unsigned char *buf, int count)
+{
+	return count;
+}
+
+static void d_put_char(struct tty_struct *tty, unsigned char c)
+{
+}
+
+static int d_write_room(struct tty_struct *tty)
+{
+	return 4096;
+}
+
+static int d_chars_in_buffer(struct tty_struct *tty)
+{
+	return 0;
+}
+
+static struct termios tio;
+static struct tty_struct tty;
+static struct inode inode = { 1 };
+static struct file file = { &inode, O_NONBLOCK, 1 };
+
+static void setup(struct tty_ldisc *ld, unsigned long lflag)
+{
+	memset(&tty, 0, sizeof(tty));
+	memset(&tio, 0, sizeof(tio));
+	tio.c_iflag = ICRNL | IXON;
+	tio.c_oflag = OPOST | ONLCR;
+	tio.c_lflag = lflag;
+	tio.c_cc[VINTR] = 3;
+	tio.c_cc[VQUIT] = 28;
+	tio.c_cc[VERASE] = 127;
+	tio.c_cc[VKILL] = 21;
+	tio.c_cc[VEOF] = 4;
+	tio.c_cc[VSTART] = 17;
+	tio.c_cc[VSTOP] = 19;
+	tio.c_cc[VSUSP] = 26;
+	tio.c_cc[VREPRINT] = 18;
+	tio.c_cc[VWERASE] = 23;
+	tio.c_cc[VLNEXT] = 22;
+	tty.termios = &tio;
+	tty.driver.write = d_write;
+	tty.driver.put_char = d_put_char;
+	tty.driver.write_room = d_write_room;
+	tty.driver.chars_in_buffer = d_chars_in_buffer;
+	ld->open(&tty);
+}
+
+/*
+ * Mostly printable text and newlines, as typed or pasted, with one
+ * byte in sixteen anything at all.
+ */
+static void fill(unsigned char *buf, int n)
+{
+	unsigned long r = 1;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		r = r * 1103515245 + 12345;
+		if ((r >> 16) % 16 == 0)
+			buf[i] = r >> 8;
+		else if ((r >> 16) % 61 == 0)
+			buf[i] = '\n';
+		else
+			buf[i] = ' ' + (r >> 8) % 95;
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Nanoseconds per byte that ld spends receiving buf. */
+static double run(struct tty_ldisc *ld, unsigned long lflag,
+		  const unsigned char *buf, int n)
+{
+	unsigned char line[N_TTY_BUF_SIZE];
+	double start, total = 0;
+	int i, r;
+
+	setup(ld, lflag);
+	for (i = 0; i < n; i += CHUNK) {
+		start = now();
+		ld->receive_buf(&tty, buf + i, NULL, MIN(CHUNK, n - i));
+		total += now() - start;
+
+		/* An empty read is a line that was just EOF. */
+		do
+			r = ld->read(&tty, &file, line, sizeof(line));
+		while (r > 0 || (r == 0 && tty.canon_data));
+	}
+	ld->close(&tty);
+	return total / n;
+}
+
+static void compare(const char *name, unsigned long lflag,
+		    const unsigned char *buf, int n)
+{
+	double before, after;
+
+	before = run(&base_ldisc, lflag, buf, n);
+	after = run(&tty_ldisc_N_TTY, lflag, buf, n);
+	printf("%s:\n\tbefore %6.2f ns/byte, after %6.2f ns/byte\n",
+	       name, before, after);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned char *buf;
+	int n = 16;
+
+	if (argc > 1)
+		n = atoi(argv[1]);
+	if (n <= 0) {
+		fprintf(stderr, "usage: %s [megabytes]\n", argv[0]);
+		return 1;
+	}
+	n <<= 20;
+	buf = malloc(n);
+	if (!buf) {
+		fprintf(stderr, "%s: out of memory\n", argv[0]);
+		return 1;
+	}
+	fill(buf, n);
+
+	compare("canonical", ISIG | ICANON | ECHO | ECHOE | ECHOK |
+		ECHOCTL | ECHOKE | IEXTEN, buf, n);
+	compare("canonical, EMACS", ISIG | ICANON | ECHO | ECHOE | ECHOK |
+		ECHOCTL | ECHOKE | IEXTEN | EMACS, buf, n);
+	compare("canonical, no echo", ISIG | ICANON | IEXTEN, buf, n);
+	compare("non-canonical", ISIG | ECHO | IEXTEN, buf, n);
+	free(buf);
+	return 0;
+}
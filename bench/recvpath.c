@@ -0,0 +1,10 @@
+/*
+ * recvpath.c -- one version of n_tty.c for recv to time
+ *
+ * The Makefile compiles this once with NTTY set to the current n_tty.c
+ * and once to the one from before the receive tables, renaming the
+ * latter's global symbols so that both can be linked into recv.
+ */
+
+#include "kstub.h"
+#include NTTY
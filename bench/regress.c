@@ -0,0 +1,235 @@
+/*
+ * regress.c -- check what n_tty sends the terminal in cases that have
+ * gone wrong before
+ *
+ * Each case types at a tty, and maybe has the program write to it,
+ * then compares the bytes that went to the driver with what a
+ * terminal needs to see.  Prints the cases that fail and exits 1 if
+ * there were any.
+ */
+
+#include "kstub.h"
+#include "nt.c"
+
+static unsigned char out[65536];
+static int outn, room;
+
+static int d_write(struct tty_struct *tty, int from_user,
+		   const unsigned char *buf, int count)
+{
+	int n;
+
+	count = MIN(count, room);
+	n = MIN(count, (int) sizeof(out) - outn);
+	memcpy(out + outn, buf, n);
+	outn += n;
+	return count;
+}
+
+static void d_put_char(struct tty_struct *tty, unsigned char c)
+{
+	d_write(tty, 0, &c, 1);
+}
+
+static int d_write_room(struct tty_struct *tty)
+{
+	return room;
+}
+
+static int d_chars_in_buffer(struct tty_struct *tty)
+{
+	return 0;
+}
+
+static struct termios tio;
+static struct tty_struct tty;
+static struct inode inode = { 1 };
+static struct file file = { &inode, 0, 3 };
+static int fails;
+
+#define COOKED	(ISIG | ICANON | ECHO | ECHOE | ECHOK | ECHOCTL | \
+		 ECHOKE | IEXTEN)
+
+static void setup(unsigned long lflag)
+{
+	if (tty.read_buf)
+		n_tty_close(&tty);
+	memset(&tty, 0, sizeof(tty));
+	memset(&tio, 0, sizeof(tio));
+	tio.c_iflag = ICRNL | IXON;
+	tio.c_oflag = OPOST | ONLCR;
+	tio.c_lflag = lflag;
+	tio.c_cc[VINTR] = 3;
+	tio.c_cc[VQUIT] = 28;
+	tio.c_cc[VERASE] = 127;
+	tio.c_cc[VKILL] = 21;
+	tio.c_cc[VEOF] = 4;
+	tio.c_cc[VSTART] = 17;
+	tio.c_cc[VSTOP] = 19;
+	tio.c_cc[VSUSP] = 26;
+	tio.c_cc[VREPRINT] = 18;
+	tio.c_cc[VWERASE] = 23;
+	tio.c_cc[VLNEXT] = 22;
+	tty.termios = &tio;
+	tty.driver.write = d_write;
+	tty.driver.put_char = d_put_char;
+	tty.driver.write_room = d_write_room;
+	tty.driver.chars_in_buffer = d_chars_in_buffer;
+	n_tty_open(&tty);
+	outn = 0;
+	room = 4096;
+}
+
+/* Type n of c, or the string s if n is 0. */
+static void type(const char *s, int n)
+{
+	unsigned char buf[1024];
+
+	if (n) {
+		memset(buf, s[0], n);
+		n_tty_receive_buf(&tty, buf, NULL, n);
+	} else
+		n_tty_receive_buf(&tty, (const unsigned char *) s, NULL,
+				  strlen(s));
+}
+
+static void program_writes(const char *s)
+{
+	write_chan(&tty, &file, (const unsigned char *) s, strlen(s));
+}
+
+static int set_input(const char *s)
+{
+	struct ttyinput ti;
+
+	ti.ti_len = strlen(s);
+	ti.ti_text = (char *) s;
+	ti.ti_magic = 0;
+	return n_tty_edit_ioctl(&tty, &file, TIOCSINPUT,
+				(unsigned long) &ti);
+}
+
+/* The line being edited, or "" if TIOCGINPUT fails. */
+static char *get_input(void)
+{
+	static char line[N_TTY_BUF_SIZE + 1];
+	struct ttyinput ti;
+
+	ti.ti_len = N_TTY_BUF_SIZE;
+	ti.ti_text = line;
+	if (n_tty_edit_ioctl(&tty, &file, TIOCGINPUT, (unsigned long) &ti))
+		ti.ti_len = 0;
+	line[ti.ti_len] = 0;
+	return line;
+}
+
+static void expect(const char *name, const char *want)
+{
+	int n = strlen(want);
+
+	if (outn != n || memcmp(out, want, n)) {
+		printf("FAIL %s: sent %d bytes, wanted %d\n", name, outn, n);
+		fails++;
+	}
+	outn = 0;
+}
+
+/*
+ * A signal flushes the line.  The prompt that follows must not leave
+ * the next key thinking there is old text after the cursor to blank.
+ */
+static void signal_then_prompt(const char *name, unsigned long lflag,
+			       int len)
+{
+	setup(lflag);
+	type("a", len);
+	type("\003", 0);
+	program_writes("\n$ ");
+	outn = 0;
+	type("l", 0);
+	expect(name, "l");
+}
+
+/*
+ * TIOCSINPUT sends the changed middle and the common ending once each,
+ * and blanks only what a shorter line leaves behind.
+ */
+static void replace(const char *name, const char *from, const char *to,
+		    const char *want)
+{
+	setup(COOKED | EMACS);
+	type(from, 0);
+	outn = 0;
+	if (set_input(to)) {
+		printf("FAIL %s: TIOCSINPUT failed\n", name);
+		fails++;
+	}
+	expect(name, want);
+}
+
+/*
+ * Going up into the history and back down again gives back the line
+ * that was being typed.
+ */
+static void history_round_trip(const char *name, const char *keys)
+{
+	char buf[N_TTY_BUF_SIZE];
+
+	setup(COOKED | EMACS | HISTORY);
+	type("echo one\n", 0);
+	type("partial", 0);
+	type(keys, 0);
+	strcpy(buf, get_input());
+	if (strcmp(buf, "partial")) {
+		printf("FAIL %s: line is \"%s\"\n", name, buf);
+		fails++;
+	}
+}
+
+/*
+ * Echo that the driver had no room for is thrown away with the rest
+ * of the output when a signal or TCFLSH flushes it, not sent after
+ * the prompt.
+ */
+static void signal_drops_echo(const char *name, int tcflsh)
+{
+	setup(COOKED);
+	room = 0;
+	type("abc", 0);
+	if (tcflsh)
+		n_tty_edit_ioctl(&tty, &file, TCFLSH, TCOFLUSH);
+	else
+		type("\003", 0);
+	room = 4096;
+	program_writes("\n$ ");
+	expect(name, "\r\n$ ");
+}
+
+int main(void)
+{
+	signal_then_prompt("^C, prompt, key", COOKED, 40);
+	signal_then_prompt("^C, prompt, key after a long line", COOKED, 300);
+	signal_then_prompt("^C, prompt, key with EMACS", COOKED | EMACS, 40);
+	signal_then_prompt("^C, prompt, key in non-canonical mode",
+			   ISIG | ECHO, 40);
+
+	replace("TIOCSINPUT to a shorter line", "ls -l /usr/local/bin",
+		"ls -l /usr/bin", "\b\b\b\b\b\b\b\b\bbin      \b\b\b\b\b\b");
+	replace("TIOCSINPUT to a longer line", "ls -l /usr/local/bin",
+		"ls -l /usr/share/local/bin",
+		"\b\b\b\b\b\b\b\b\bshare/local/bin");
+	replace("TIOCSINPUT to the same length", "cc -O foo.c",
+		"cc -g foo.c", "\b\b\b\b\b\b\bg foo.c");
+
+	history_round_trip("^P ^N keeps the typed line", "\020\016");
+	history_round_trip("^P PageDown keeps the typed line",
+			   "\020\033[6~");
+	history_round_trip("PageUp ^N keeps the typed line", "\033[5~\016");
+
+	signal_drops_echo("^C drops echo the driver had no room for", 0);
+	signal_drops_echo("TCOFLUSH drops echo the driver had no room for", 1);
+
+	n_tty_close(&tty);
+	printf(fails ? "%d failed\n" : "all passed\n", fails);
+	return fails != 0;
+}
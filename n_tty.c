@@ -58,53 +58,149 @@
 #define TTY_THRESHOLD_UNTHROTTLE 	128
 
 #define BUF_MASK(n) ((n) & (N_TTY_BUF_SIZE - 1))
+
+/* Size of the buffer collecting echo output between driver writes. */
+#define N_TTY_ECHO_SIZE 512
+
+/* Number of screen columns whose contents tty_type_extra() remembers. */
+#define N_TTY_SHADOW_SIZE 1024
+
+/* echo_buf, shadow and read_width share one allocation. */
+#define N_TTY_EDIT_ALLOC \
+	(N_TTY_ECHO_SIZE + N_TTY_SHADOW_SIZE + N_TTY_BUF_SIZE)
+
 #define CTRL(n) ((n) & 31)
 
 #define K_BS  (CTRL ('h'))
 #define K_DEL 127
 #define K_ESC 27
 
+/*
+ * The editing modes, as in the BSD termios.  These belong in
+ * <asm/termbits.h> and <linux/tty.h> with the other local flags.
+ */
+#ifndef EMACS
+#define SETERASE	0200000	/* make ^H or ^? ERASE, whichever is typed */
+#define EMACS		0400000	/* emacs-style editing keys */
+#define HISTORY		01000000 /* keep history of recent input */
+#endif
+#ifndef L_EMACS
+#define L_SETERASE(tty)	_L_FLAG((tty),SETERASE)
+#define L_EMACS(tty)	_L_FLAG((tty),EMACS)
+#define L_HISTORY(tty)	_L_FLAG((tty),HISTORY)
+#endif
+
+/*
+ * Bytes of history kept per tty (a power of two), and for all ttys
+ * together.
+ */
+#define N_TTY_HIST_SIZE		2048
+#define N_TTY_HIST_TOTAL	(64 * N_TTY_HIST_SIZE)
+
 static int tty_fwd_char (struct tty_struct *);
 static int tty_back_char (struct tty_struct *);
-static void tty_type_extra (struct tty_struct *, int);
+static void tty_type_extra (struct tty_struct *);
+static void n_tty_set_termios (struct tty_struct *, struct termios *);
 
-static inline void put_tty_queue(unsigned char c, struct tty_struct *tty)
+/*
+ * The line being edited in canonical mode is kept as a gap buffer
+ * inside read_buf.  Characters before the cursor run from canon_head
+ * up to read_head, just like ordinary input; the read_extra characters
+ * after the cursor sit at the far end of the free space, ending just
+ * before read_extra_end.  Typing and rubbing out at the cursor only
+ * move read_head, and moving the cursor moves one character across
+ * the gap, so none of them depend on the length of the line.
+ */
+#define EXTRA_START(tty) BUF_MASK((tty)->read_extra_end - (tty)->read_extra)
+#define EXTRA_CHAR(tty, n) \
+	((tty)->read_buf[BUF_MASK(EXTRA_START(tty) + (n))])
+
+/*
+ * The reader frees space behind the characters after the cursor, not
+ * in front of them, so once the gap closes up they may have to be
+ * slid up against read_tail to reopen it.
+ */
+static void tty_open_gap(struct tty_struct *tty)
 {
-	if (tty->read_cnt + tty->read_extra < N_TTY_BUF_SIZE) {
-		int n;
+	int n;
 
-		/*
-		 * If there are characters after the cursor, make room
-		 * for the new insertion.  I don't *think* it should ever
-		 * be possible to backspace past an end-of-line character,
-		 * so this doesn't bother to shift the read_flags.
-		 */
-		for (n = tty->read_extra; n > 0; n--)
-			tty->read_buf[BUF_MASK(tty->read_head + n)] =
-				tty->read_buf[BUF_MASK(tty->read_head + n - 1)];
+	for (n = 1; n <= tty->read_extra; n++)
+		tty->read_buf[BUF_MASK(tty->read_tail - n)] =
+			tty->read_buf[BUF_MASK(tty->read_extra_end - n)];
+	tty->read_extra_end = tty->read_tail;
+}
+
+/*
+ * Move the characters after the cursor back to the cursor without
+ * echoing them, leaving read_buf contiguous.
+ */
+static void tty_close_gap(struct tty_struct *tty)
+{
+	while (tty->read_extra) {
+		tty->read_buf[tty->read_head] = EXTRA_CHAR(tty, 0);
+		tty->read_head = BUF_MASK(tty->read_head + 1);
+		tty->read_cnt++;
+		tty->read_extra--;
+	}
+}
+
+/*
+ * read_width[] parallels read_buf: for each character before the
+ * cursor it holds the number of columns its echo moved the cursor, so
+ * backing up over it, a tab in particular, doesn't mean rescanning
+ * the line from canon_column.  Characters that were not echoed take
+ * no columns.
+ */
+static inline void put_tty_width(unsigned char c, unsigned char width,
+				 struct tty_struct *tty)
+{
+	if (tty->read_cnt + tty->read_extra < N_TTY_BUF_SIZE) {
+		if (tty->read_extra && tty->read_head == EXTRA_START(tty))
+			tty_open_gap(tty);
 
 		tty->read_buf[tty->read_head] = c;
+		tty->read_width[tty->read_head] = width;
 		tty->read_head = (tty->read_head + 1) & (N_TTY_BUF_SIZE-1);
 		tty->read_cnt++;
 	}
 }
 
-static inline int unput_tty_queue(struct tty_struct *tty)
+static inline void put_tty_queue(unsigned char c, struct tty_struct *tty)
 {
-	int n, c;
+	put_tty_width(c, 0, tty);
+}
 
+static inline int unput_tty_queue(struct tty_struct *tty)
+{
 	if (tty->read_head == tty->canon_head)
 		return -1;
 
-	c = tty->read_buf[tty->read_head];
 	tty->read_head = BUF_MASK (tty->read_head - 1);
 	tty->read_cnt--;
 
-	for (n = 0; n < tty->read_extra; n++)
-		tty->read_buf[BUF_MASK (tty->read_head + n)] =
-			tty->read_buf[BUF_MASK (tty->read_head + n + 1)];
+	return tty->read_buf[tty->read_head];
+}
 
-	return c;
+/*
+ * Append a run of characters at the cursor with at most two copies.
+ * The caller has made sure there is room for all of them.
+ */
+static inline void put_tty_run(const unsigned char *cp, int n,
+			       unsigned char width, struct tty_struct *tty)
+{
+	int i;
+
+	if (tty->read_extra &&
+	    BUF_MASK(EXTRA_START(tty) - tty->read_head) < n)
+		tty_open_gap(tty);
+
+	i = MIN(n, N_TTY_BUF_SIZE - tty->read_head);
+	memcpy(tty->read_buf + tty->read_head, cp, i);
+	memcpy(tty->read_buf, cp + i, n - i);
+	memset(tty->read_width + tty->read_head, width, i);
+	memset(tty->read_width, width, n - i);
+	tty->read_head = BUF_MASK(tty->read_head + n);
+	tty->read_cnt += n;
 }
 
 /*
@@ -113,7 +209,9 @@ static inline int unput_tty_queue(struct tty_struct *tty)
 void n_tty_flush_buffer(struct tty_struct * tty)
 {
 	tty->read_head = tty->read_tail = tty->read_cnt = tty->read_extra = 0;
+	tty->read_extra_end = 0;
 	tty->canon_head = tty->canon_data = tty->erasing = 0;
+	tty->shadow_end = tty->column;
 	memset(&tty->read_flags, 0, sizeof tty->read_flags);
 	
 	if (!tty->link)
@@ -143,14 +241,50 @@ int n_tty_chars_in_buffer(struct tty_struct *tty)
 }
 
 /*
- * Perform OPOST processing.  Returns -1 when the output device is
- * full and the character must be retried.
+ * To redraw the end of the line after an edit without retyping all of
+ * it, n_tty keeps a shadow of what the screen shows after the cursor:
+ * shadow[col] for columns from tty->column up to shadow_end, with 0
+ * standing for "don't know".  Everything from shadow_end on is blank.
+ * Echo that moves the cursor right needs no bookkeeping, since the
+ * columns it passes are no longer after the cursor; the ones it skips
+ * over with a tab keep their old shadow, just as they keep their old
+ * contents on the screen.  Moving left records what is being moved
+ * over.  Output that goes to the start of a line, or to a new one,
+ * starts the shadow afresh.
  */
-static int opost(unsigned char c, struct tty_struct *tty)
+static inline unsigned char shadow_cell(struct tty_struct *tty,
+					unsigned int col)
 {
-	int	space, spaces;
+	if (col >= tty->shadow_end)
+		return ' ';
+	return col < N_TTY_SHADOW_SIZE ? tty->shadow[col] : 0;
+}
+
+static inline void shadow_set(struct tty_struct *tty, unsigned int col,
+			      unsigned char g)
+{
+	if (col < N_TTY_SHADOW_SIZE)
+		tty->shadow[col] = g;
+}
+
+/* Anything typed past shadow_end went onto blank columns. */
+static inline void shadow_sync(struct tty_struct *tty)
+{
+	while (tty->shadow_end < tty->column)
+		shadow_set(tty, tty->shadow_end++, ' ');
+}
+
+/*
+ * Perform OPOST processing, leaving the bytes to send in out, which
+ * must have room for eight of them.  Returns how many there are, or -1
+ * when they need more than space bytes and the character must be
+ * retried.
+ */
+static int do_opost(unsigned char c, struct tty_struct *tty, int space,
+		    unsigned char *out)
+{
+	int	spaces, n = 0;
 
-	space = tty->driver.write_room(tty);
 	if (!space)
 		return -1;
 
@@ -162,10 +296,11 @@ static int opost(unsigned char c, struct tty_struct *tty)
 			if (O_ONLCR(tty)) {
 				if (space < 2)
 					return -1;
-				tty->driver.put_char(tty, '\r');
+				out[n++] = '\r';
 				tty->column = 0;
 			}
 			tty->canon_column = tty->column;
+			tty->shadow_end = tty->column;	/* a fresh line */
 			break;
 		case '\r':
 			if (O_ONOCR(tty) && tty->column == 0)
@@ -174,9 +309,11 @@ static int opost(unsigned char c, struct tty_struct *tty)
 				c = '\n';
 				if (O_ONLRET(tty))
 					tty->canon_column = tty->column = 0;
+				tty->shadow_end = tty->column;
 				break;
 			}
 			tty->canon_column = tty->column = 0;
+			tty->shadow_end = 0;
 			break;
 		case '\t':
 			spaces = 8 - (tty->column & 7);
@@ -184,14 +321,16 @@ static int opost(unsigned char c, struct tty_struct *tty)
 				if (space < spaces)
 					return -1;
 				tty->column += spaces;
-				tty->driver.write(tty, 0, "        ", spaces);
-				return 0;
+				memcpy(out, "        ", spaces);
+				return spaces;
 			}
 			tty->column += spaces;
 			break;
 		case '\b':
-			if (tty->column > 0)
+			if (tty->column > 0) {
 				tty->column--;
+				shadow_set(tty, tty->column, 0);
+			}
 			break;
 		default:
 			if (O_OLCUC(tty))
@@ -201,13 +340,145 @@ static int opost(unsigned char c, struct tty_struct *tty)
 			break;
 		}
 	}
-	tty->driver.put_char(tty, c);
+	out[n++] = c;
+	return n;
+}
+
+/*
+ * opost_map[c] says what do_opost() would do with c in the current
+ * termios: for most characters, nothing but move the cursor one column
+ * or none, and OPOST_SLOW marks the rest.  It is rebuilt whenever the
+ * termios changes.
+ */
+#define OPOST_SLOW 0xff
+
+static void n_tty_set_opost_map(struct tty_struct *tty)
+{
+	int c;
+
+	for (c = 0; c < 256; c++) {
+		if (O_OLCUC(tty) && islower(c))
+			tty->opost_map[c] = OPOST_SLOW;
+		else
+			tty->opost_map[c] = iscntrl(c) ? 0 : 1;
+	}
+	tty->opost_map['\n'] = OPOST_SLOW;
+	tty->opost_map['\r'] = OPOST_SLOW;
+	tty->opost_map['\t'] = OPOST_SLOW;
+	tty->opost_map['\b'] = OPOST_SLOW;
+}
+
+/*
+ * Perform OPOST processing straight to the driver.  Returns -1 when the
+ * output device is full and the character must be retried.
+ */
+static int opost(unsigned char c, struct tty_struct *tty)
+{
+	unsigned char out[8];
+	int n;
+
+	n = do_opost(c, tty, tty->driver.write_room(tty), out);
+	if (n < 0)
+		return -1;
+	if (n == 1)
+		tty->driver.put_char(tty, out[0]);
+	else if (n)
+		tty->driver.write(tty, 0, out, n);
 	return 0;
 }
 
+/*
+ * Hand the driver, in one write, the leading run of characters from
+ * user space that OPOST passes through unchanged.  Returns how many it
+ * took, which is 0 when the first character needs opost() or there is
+ * no room.
+ */
+static int opost_run(struct tty_struct *tty, const unsigned char *b, int nr)
+{
+	int	i, n, cols = 0;
+	unsigned char a;
+
+	nr = MIN(nr, tty->driver.write_room(tty));
+	for (n = 0; n < nr; n++) {
+		a = tty->opost_map[get_user(b + n)];
+		if (a == OPOST_SLOW)
+			break;
+		cols += a;
+	}
+	if (!n)
+		return 0;
+	i = tty->driver.write(tty, 1, b, n);
+	if (i < n) {
+		/* Only count the columns that made it out. */
+		cols = 0;
+		for (n = 0; n < i; n++)
+			cols += tty->opost_map[get_user(b + n)];
+	}
+	tty->column += cols;
+	return i;
+}
+
+/*
+ * Echo output is collected in echo_buf while a batch of input is being
+ * processed and handed to the driver with a single write afterwards,
+ * rather than a driver call for every byte.  Whatever the driver has
+ * no room for stays in echo_buf until write_wakeup; if echo_buf itself
+ * fills up, further echo is dropped, as it would have been before.
+ */
+static void n_tty_flush_echo(struct tty_struct *tty)
+{
+	unsigned long flags;
+	int n;
+
+	save_flags(flags);
+	cli();
+	if (tty->echo_cnt) {
+		n = tty->driver.write(tty, 0, tty->echo_buf, tty->echo_cnt);
+		if (n > 0) {
+			tty->echo_cnt -= n;
+			memmove(tty->echo_buf, tty->echo_buf + n, tty->echo_cnt);
+		}
+		if (tty->echo_cnt)
+			set_bit(TTY_DO_WRITE_WAKEUP, &tty->flags);
+	}
+	restore_flags(flags);
+}
+
+static void echo_write(const unsigned char *cp, int n,
+		       struct tty_struct *tty)
+{
+	int i;
+
+	while (n > 0) {
+		if (tty->echo_cnt == N_TTY_ECHO_SIZE) {
+			n_tty_flush_echo(tty);
+			if (tty->echo_cnt == N_TTY_ECHO_SIZE)
+				return;
+		}
+		i = MIN(n, N_TTY_ECHO_SIZE - tty->echo_cnt);
+		memcpy(tty->echo_buf + tty->echo_cnt, cp, i);
+		tty->echo_cnt += i;
+		tty->echo_bytes += i;
+		cp += i;
+		n -= i;
+	}
+}
+
 static inline void put_char(unsigned char c, struct tty_struct *tty)
 {
-	tty->driver.put_char(tty, c);
+	echo_write(&c, 1, tty);
+}
+
+/* OPOST processing into the echo buffer. */
+
+static void echo_post(unsigned char c, struct tty_struct *tty)
+{
+	unsigned char out[8];
+	int n;
+
+	n = do_opost(c, tty, sizeof(out), out);
+	if (n > 0)
+		echo_write(out, n, tty);
 }
 
 /* Must be called only when L_ECHO(tty) is true. */
@@ -218,8 +489,24 @@ static void echo_char(unsigned char c, struct tty_struct *tty)
 		put_char('^', tty);
 		put_char(c ^ 0100, tty);
 		tty->column += 2;
+	} else if (c == '\t' && O_OPOST(tty)) {
+		unsigned int col, start = tty->column, stop = (start | 7) + 1;
+
+		/* Blank out anything a real tab would leave showing. */
+		for (col = start; col < stop; col++)
+			if (shadow_cell(tty, col) != ' ')
+				break;
+		if (col == stop)
+			echo_post(c, tty);
+		else
+			while (tty->column < stop) {
+				put_char(' ', tty);
+				tty->column++;
+			}
+		for (col = start; col < stop; col++)
+			shadow_set(tty, col, ' ');
 	} else
-		opost(c, tty);
+		echo_post(c, tty);
 }
 
 static inline void finish_erasing(struct tty_struct *tty)
@@ -231,35 +518,58 @@ static inline void finish_erasing(struct tty_struct *tty)
 	}
 }
 
-static inline void backspace_over_tab(struct tty_struct *tty)
+/* Columns taken by an echo that started at col. */
+static inline unsigned char echo_width(struct tty_struct *tty,
+				       unsigned int col)
 {
-	unsigned int col = tty->canon_column;
-	unsigned long tail = tty->canon_head;
-	unsigned char c;
+	return tty->column > col ? tty->column - col : 0;
+}
+
+/*
+ * Store in g what echo_char() shows for c when the cursor is at col,
+ * and return the number of columns it takes.  Tabs count as blanks.
+ */
+static int echo_glyphs(unsigned char c, unsigned int col,
+		       struct tty_struct *tty, unsigned char *g)
+{
+	int n;
+
+	if (c == '\t') {
+		n = 8 - (col & 7);
+		memset(g, ' ', n);
+		return n;
+	}
+	if (iscntrl(c)) {
+		if (!L_ECHOCTL(tty))
+			return 0;
+		g[0] = '^';
+		g[1] = c ^ 0100;
+		return 2;
+	}
+	g[0] = c;
+	return 1;
+}
 
-	/* Find the column of the last char. */
-	while (tail != tty->read_head) {
-		c = tty->read_buf[tail];
-		if (c == '\t')
-			col = (col | 7) + 1;
-		else if (iscntrl(c)) {
-			if (L_ECHOCTL(tty))
-				col += 2;
-		} else
-			col++;
-		tail = (tail+1) & (N_TTY_BUF_SIZE-1);
-	}
-
-	/* should never happen */
-	if (tty->column > 0x80000000)
-		tty->column = 0; 
-
-	/* Now backup to that column. */
-	while (tty->column > col) {
+/*
+ * Back the cursor up over c, which has just been taken off the end of
+ * read_buf, without erasing it from the screen.
+ */
+static void tty_move_back(struct tty_struct *tty, unsigned char c)
+{
+	unsigned char g[8];
+	unsigned int w = tty->read_width[tty->read_head];
+
+	shadow_sync(tty);
+	if (w > tty->column)
+		w = tty->column;
+	/* If the echo wasn't the usual one, we don't know what it left. */
+	if (echo_glyphs(c, tty->column - w, tty, g) != w)
+		memset(g, 0, sizeof(g));
+	while (w-- > 0) {
 		/* Can't use opost here. */
 		put_char('\b', tty);
-		if (tty->column > 0)
-			tty->column--;
+		tty->column--;
+		shadow_set(tty, tty->column, w < sizeof(g) ? g[w] : 0);
 	}
 }
 
@@ -267,9 +577,9 @@ static void eraser(unsigned char c, struct tty_struct *tty)
 {
 	enum { ERASE, WERASE, KILL } kill_type;
 	int head, seen_alnums;
-	int orig_col = tty->column;
 
-	if (tty->read_head == tty->canon_head) {
+	if (tty->read_head == tty->canon_head &&
+	    (!tty->read_extra || c != KILL_CHAR(tty))) {
 		/* opost('\a', tty); */		/* what do you think? */
 		return;
 	}
@@ -285,17 +595,17 @@ static void eraser(unsigned char c, struct tty_struct *tty)
 		 * and in general it feels like a sensible way to behave.
 		 */
 
-		if (tty->read_extra)
-			while (tty_fwd_char (tty) >= 0)
-				;
-
 		if (!L_ECHO(tty)) {
 			tty->read_cnt -= ((tty->read_head - tty->canon_head) &
 					  (N_TTY_BUF_SIZE - 1));
 			tty->read_head = tty->canon_head;
+			tty->read_extra = 0;
 			return;
 		}
 		if (!L_ECHOK(tty) || !L_ECHOKE(tty) || !L_ECHOE(tty)) {
+			if (tty->read_extra)
+				while (tty_fwd_char (tty) >= 0)
+					;
 			tty->read_cnt -= ((tty->read_head - tty->canon_head) &
 					  (N_TTY_BUF_SIZE - 1));
 			tty->read_head = tty->canon_head;
@@ -303,9 +613,12 @@ static void eraser(unsigned char c, struct tty_struct *tty)
 			echo_char(KILL_CHAR(tty), tty);
 			/* Add a newline if ECHOK is on and ECHOKE is off. */
 			if (L_ECHOK(tty))
-				opost('\n', tty);
+				echo_post('\n', tty);
+			tty->shadow_end = tty->column;
 			return;
 		}
+		/* tty_type_extra() below blanks these out. */
+		tty->read_extra = 0;
 		kill_type = KILL;
 	}
 
@@ -331,23 +644,12 @@ static void eraser(unsigned char c, struct tty_struct *tty)
 				echo_char(c, tty);
 			} else if (kill_type == ERASE && !L_ECHOE(tty)) {
 				echo_char(ERASE_CHAR(tty), tty);
-			} else if (c == '\t') {
-				backspace_over_tab (tty);
 			} else {
-				if (iscntrl(c) && L_ECHOCTL(tty)) {
-					put_char('\b', tty);
-					put_char(' ', tty);
-					put_char('\b', tty);
-					if (tty->column > 0)
-						tty->column--;
-				}
-				if (!iscntrl(c) || L_ECHOCTL(tty)) {
-					put_char('\b', tty);
-					put_char(' ', tty);
-					put_char('\b', tty);
-					if (tty->column > 0)
-						tty->column--;
-				}
+				/*
+				 * Just back up; tty_type_extra() then blanks
+				 * or rewrites only what needs it.
+				 */
+				tty_move_back(tty, c);
 			}
 		}
 		if (kill_type == ERASE)
@@ -355,8 +657,7 @@ static void eraser(unsigned char c, struct tty_struct *tty)
 	}
 	if (tty->read_head == tty->canon_head)
 		finish_erasing(tty);
-	if (tty->read_extra)
-		tty_type_extra (tty, orig_col - tty->column);
+	tty_type_extra (tty);
 }
 
 static inline void isig(int sig, struct tty_struct *tty, int flush)
@@ -365,6 +666,7 @@ static inline void isig(int sig, struct tty_struct *tty, int flush)
 		kill_pg(tty->pgrp, sig, 1);
 	if (flush || !L_NOFLSH(tty)) {
 		n_tty_flush_buffer(tty);
+		tty->echo_cnt = 0;	/* goes with the driver's output */
 		if (tty->driver.flush_buffer)
 			tty->driver.flush_buffer(tty);
 	}
@@ -416,8 +718,711 @@ static inline void n_tty_receive_parity_error(struct tty_struct *tty,
 	wake_up_interruptible(&tty->read_wait);
 }
 
+/*
+ * n_tty_set_termios() compiles the input flags and control characters
+ * into two tables indexed by the byte received.  recv_xlat gives the
+ * byte after ISTRIP, IUCLC, ICRNL and INLCR.  recv_action says what to
+ * do with it: the low four bits are checked first, and the high four
+ * bits say what it does to the line being edited.
+ */
+#define RECV_EARLY(a)	((a) & 15)
+#define RECV_LATE(a)	((a) >> 4)
+
+/* Early actions. */
+#define RA_NONE		0	/* go on to the late action */
+#define RA_FAST		1	/* not in process_char_map */
+#define RA_IGNORE	2	/* IGNCR */
+#define RA_START	3
+#define RA_STOP		4
+#define RA_INTR		5
+#define RA_QUIT		6
+#define RA_SUSP		7
+#define RA_ERASE	8	/* ERASE, KILL and WERASE */
+#define RA_LNEXT	9
+#define RA_REPRINT	10
+#define RA_SETERASE	11	/* the ERASE key SETERASE doesn't know yet */
+
+/*
+ * Late actions.  Those below RL_NR_EDIT are the editing actions a
+ * keymap binds keys to, so their numbers are part of the TIOCSKEYMAP
+ * interface.
+ */
+#define RL_PLAIN	0	/* just another character */
+#define RL_ESC		1	/* start of an escape sequence */
+#define RL_FWD		2
+#define RL_BACK		3
+#define RL_HOME		4
+#define RL_END		5
+#define RL_DELETE	6	/* or whatever else it is with nothing to delete */
+#define RL_KILL_EOL	7
+#define RL_RUBOUT	8
+#define RL_HIST_PREV	9
+#define RL_HIST_NEXT	10
+#define RL_DELETE_FWD	11
+#define RL_WORD_FWD	12
+#define RL_WORD_BACK	13
+#define RL_HIST_FIRST	14
+#define RL_HIST_LAST	15
+#define RL_NR_EDIT	16
+#define RL_NEWLINE	16
+#define RL_EOF		17
+#define RL_EOL		18
+
+/*
+ * The editing keys come from a keymap, which binds single bytes and
+ * the final characters of escape sequences to editing actions.  These
+ * belong with the other tty ioctls in <asm/ioctls.h> and <linux/tty.h>.
+ */
+#ifndef TIOCGKEYMAP
+#define TIOCGKEYMAP	0x5470
+#define TIOCSKEYMAP	0x5471
+
+struct tty_keymap {
+	unsigned char km_key[256];	/* by byte received */
+	unsigned char km_final[64];	/* by final char of ESC [ or ESC O */
+	unsigned char km_tilde[32];	/* by parameter of ESC [ n ~ */
+};
+#endif
+
+/*
+ * A program can fetch and replace the line being edited, so that it
+ * can offer something to be edited rather than typed from scratch.
+ * ti_magic lets it replace only a line that hasn't changed since it
+ * fetched it; zero replaces whatever is there.
+ */
+#ifndef TIOCGINPUT
+#define TIOCGINPUT	0x5472
+#define TIOCSINPUT	0x5473
+#define TIOCTOEOL	0x5474
+
+struct ttyinput {
+	int ti_len;
+	char *ti_text;
+	int ti_magic;
+};
+#endif
+
+/*
+ * What redrawing the line has cost so far on a tty: all the bytes
+ * echoed, and how many keystrokes were edits in the middle of the line
+ * and how many of the echoed bytes they took.  The counts only go up;
+ * take the difference of two readings.
+ * Anyone who can open the tty may read them.
+ */
+#ifndef TIOCGEDSTATS
+#define TIOCGEDSTATS	0x5475
+
+struct tty_edstats {
+	unsigned long es_echo_bytes;	/* bytes echoed */
+	unsigned long es_edit_count;	/* keystrokes with text after cursor */
+	unsigned long es_edit_bytes;	/* bytes those echoed */
+};
+#endif
+
+/*
+ * Keymaps in use are kept on a list and shared by every tty that
+ * loads the same one.  The default never goes away.
+ */
+struct n_tty_keymap {
+	struct n_tty_keymap *next;
+	int count;
+	struct tty_keymap map;
+};
+
+static struct n_tty_keymap default_keymap = {
+	NULL, 1, {
+		{
+			[K_ESC]		= RL_ESC,
+			[CTRL('f')]	= RL_FWD,
+			[CTRL('b')]	= RL_BACK,
+			[CTRL('a')]	= RL_HOME,
+			[CTRL('e')]	= RL_END,
+			[CTRL('d')]	= RL_DELETE,
+			[CTRL('k')]	= RL_KILL_EOL,
+			[CTRL('p')]	= RL_HIST_PREV,
+			[CTRL('n')]	= RL_HIST_NEXT,
+			[K_BS]		= RL_RUBOUT,
+			[K_DEL]		= RL_RUBOUT,
+		}, {
+			['A' - '@']	= RL_HIST_PREV,
+			['B' - '@']	= RL_HIST_NEXT,
+			['C' - '@']	= RL_FWD,
+			['D' - '@']	= RL_BACK,
+			['F' - '@']	= RL_END,
+			['H' - '@']	= RL_HOME,
+		}, {
+			[1]		= RL_HOME,
+			[3]		= RL_DELETE_FWD,
+			[4]		= RL_END,
+			[5]		= RL_HIST_FIRST,
+			[6]		= RL_HIST_LAST,
+			[7]		= RL_HOME,
+			[8]		= RL_END,
+		}
+	}
+};
+
+static struct n_tty_keymap *keymaps = &default_keymap;
+
+static void n_tty_put_keymap(struct n_tty_keymap *km)
+{
+	struct n_tty_keymap **p;
+
+	if (--km->count)
+		return;
+	for (p = &keymaps; *p; p = &(*p)->next)
+		if (*p == km) {
+			*p = km->next;
+			break;
+		}
+	kfree_s(km, sizeof(*km));
+}
+
+/*
+ * Find the shared copy of map, adding it if nobody has it loaded.
+ * Returns NULL if out of memory.
+ */
+static struct n_tty_keymap *n_tty_get_keymap(struct tty_keymap *map)
+{
+	struct n_tty_keymap *km;
+
+	for (km = keymaps; km; km = km->next)
+		if (!memcmp(&km->map, map, sizeof(*map))) {
+			km->count++;
+			return km;
+		}
+	km = (struct n_tty_keymap *) kmalloc(sizeof(*km), GFP_KERNEL);
+	if (!km)
+		return NULL;
+	km->map = *map;
+	km->count = 1;
+	km->next = keymaps;
+	keymaps = km;
+	return km;
+}
+
+/* ISTRIP and IUCLC, for the rare cases that must not see ICRNL/INLCR. */
+static inline unsigned char n_tty_strip(struct tty_struct *tty,
+					unsigned char c)
+{
+	if (I_ISTRIP(tty))
+		c &= 0x7f;
+	if (I_IUCLC(tty) && L_IEXTEN(tty))
+		c = tolower(c);
+	return c;
+}
+
+/* The keymap's action for c; the history keys need HISTORY too. */
+static int n_tty_key_action(struct tty_struct *tty, unsigned char c)
+{
+	int action = tty->keymap->map.km_key[c];
+
+	switch (action) {
+	case RL_HIST_PREV:
+	case RL_HIST_NEXT:
+	case RL_HIST_FIRST:
+	case RL_HIST_LAST:
+		if (!L_HISTORY(tty))
+			return RL_PLAIN;
+	}
+	return action;
+}
+
+/* Whether c ends a line, in canonical mode. */
+static int n_tty_line_action(struct tty_struct *tty, unsigned char c)
+{
+	if (c == '\n')
+		return RL_NEWLINE;
+	if (c == EOF_CHAR(tty))
+		return RL_EOF;
+	if ((c == EOL_CHAR(tty)) ||
+	    (c == EOL2_CHAR(tty) && L_IEXTEN(tty)))
+		return RL_EOL;
+	return RL_PLAIN;
+}
+
+/*
+ * The chain of tests that decides what becomes of byte r: the byte
+ * it turns into goes in *xlat and the action is returned.  This is
+ * what the receive path used to work out for every byte; now it is
+ * only run to fill in the tables.  process_char_map must be up to
+ * date.
+ */
+static inline int n_tty_recv_classify(struct tty_struct *tty, int r,
+				      unsigned char *xlat)
+{
+	unsigned char s, c;
+	int early, late;
+
+	s = c = n_tty_strip(tty, r);
+	if (c == '\r') {
+		if (I_ICRNL(tty))
+			c = '\n';
+	} else if (c == '\n' && I_INLCR(tty))
+		c = '\r';
+	*xlat = c;
+
+	early = RA_NONE;
+	late = RL_PLAIN;
+	if (!test_bit(s, &tty->process_char_map))
+		early = RA_FAST;
+	else if (s == '\r' && I_IGNCR(tty))
+		early = RA_IGNORE;
+	else if (I_IXON(tty) && c == START_CHAR(tty))
+		early = RA_START;
+	else if (I_IXON(tty) && c == STOP_CHAR(tty))
+		early = RA_STOP;
+	else if (L_ISIG(tty) && c == INTR_CHAR(tty))
+		early = RA_INTR;
+	else if (L_ISIG(tty) && c == QUIT_CHAR(tty))
+		early = RA_QUIT;
+	else if (L_ISIG(tty) && c == SUSP_CHAR(tty))
+		early = RA_SUSP;
+	else if (L_ICANON(tty)) {
+		if (c == ERASE_CHAR(tty) || c == KILL_CHAR(tty) ||
+		    (c == WERASE_CHAR(tty) && L_IEXTEN(tty)))
+			early = RA_ERASE;
+		else if (L_SETERASE(tty) && (c == K_BS || c == K_DEL))
+			early = RA_SETERASE;
+		else if (c == LNEXT_CHAR(tty) && L_IEXTEN(tty))
+			early = RA_LNEXT;
+		else if (c == REPRINT_CHAR(tty) && L_ECHO(tty) &&
+			 L_IEXTEN(tty))
+			early = RA_REPRINT;
+	}
+	if (L_ICANON(tty)) {
+		if (L_EMACS(tty) && L_IEXTEN(tty))
+			late = n_tty_key_action(tty, c);
+		if (late == RL_PLAIN)
+			late = n_tty_line_action(tty, c);
+	}
+	return early | (late << 4);
+}
+
+/* Called from n_tty_set_termios() with process_char_map up to date. */
+static void n_tty_set_recv_map(struct tty_struct *tty)
+{
+	int r;
+
+	for (r = 0; r < 256; r++)
+		tty->recv_action[r] = n_tty_recv_classify(tty, r,
+							  &tty->recv_xlat[r]);
+}
+
+/*
+ * The escape sequences sent by cursor and editing keys are parsed by a
+ * small DFA.  tty->esc holds its state between characters and
+ * esc_param[] collects up to two numeric parameters, as in the
+ * "ESC [ 1 ; 5 C" that xterm sends for ctrl-right.
+ */
+#define ES_NONE		0
+#define ES_ESC		1	/* seen ESC */
+#define ES_CSI		2	/* seen ESC [ */
+#define ES_SS3		3	/* seen ESC O */
+#define ES_DONE		4	/* final character: look up the key */
+#define ES_BAD		5	/* no sequence we know */
+#define ES_ABORT	6	/* not part of a sequence at all */
+
+/*
+ * With HISTORY set, each line entered with ECHO on is saved in a ring
+ * of N_TTY_HIST_SIZE bytes, allocated the first time there is one to
+ * keep.  An entry is its length in two bytes, the text, and the length
+ * again, so the ring can be walked both ways; the oldest entries are
+ * dropped to make room.  pos is the entry being shown, or head.
+ * Whatever was being typed when pos left head is kept in stash, to be
+ * put back when it returns.
+ */
+struct n_tty_hist {
+	int head, tail, used, pos;
+	unsigned char buf[N_TTY_HIST_SIZE];
+	int stash_len;
+	unsigned char stash[N_TTY_HIST_SIZE];
+};
+
+#define HIST_MASK(n) ((n) & (N_TTY_HIST_SIZE - 1))
+
+static int n_tty_hist_total;
+
+static inline int hist_len(struct n_tty_hist *h, int at)
+{
+	return h->buf[HIST_MASK(at)] | (h->buf[HIST_MASK(at + 1)] << 8);
+}
+
+static inline void hist_put_len(struct n_tty_hist *h, int len)
+{
+	h->buf[h->head] = len & 0xff;
+	h->buf[HIST_MASK(h->head + 1)] = len >> 8;
+	h->head = HIST_MASK(h->head + 2);
+}
+
+/* Save the line from canon_head to read_head, which is being entered. */
+static void n_tty_hist_add(struct tty_struct *tty)
+{
+	struct n_tty_hist *h = tty->history;
+	int len = BUF_MASK(tty->read_head - tty->canon_head);
+	int i, at;
+
+	/* Always leave a byte free, so that head == tail means empty. */
+	if (!len || len + 4 >= N_TTY_HIST_SIZE)
+		return;
+	if (!h) {
+		if (n_tty_hist_total + sizeof(*h) > N_TTY_HIST_TOTAL)
+			return;
+		h = (struct n_tty_hist *) kmalloc(sizeof(*h), GFP_ATOMIC);
+		if (!h)
+			return;
+		h->head = h->tail = h->used = h->pos = h->stash_len = 0;
+		tty->history = h;
+		n_tty_hist_total += sizeof(*h);
+	}
+	h->pos = h->head;
+
+	/* Don't save the same line twice running. */
+	if (h->used && hist_len(h, h->head - 2) == len) {
+		at = h->head - 2 - len;
+		for (i = 0; i < len; i++)
+			if (h->buf[HIST_MASK(at + i)] !=
+			    tty->read_buf[BUF_MASK(tty->canon_head + i)])
+				break;
+		if (i == len)
+			return;
+	}
+
+	while (N_TTY_HIST_SIZE - h->used <= len + 4) {
+		i = hist_len(h, h->tail) + 4;
+		h->tail = HIST_MASK(h->tail + i);
+		h->used -= i;
+	}
+	hist_put_len(h, len);
+	for (i = 0; i < len; i++) {
+		h->buf[h->head] = tty->read_buf[BUF_MASK(tty->canon_head + i)];
+		h->head = HIST_MASK(h->head + 1);
+	}
+	hist_put_len(h, len);
+	h->used += len + 4;
+	h->pos = h->head;
+}
+
+static void n_tty_hist_free(struct tty_struct *tty)
+{
+	if (tty->history) {
+		kfree_s(tty->history, sizeof(struct n_tty_hist));
+		n_tty_hist_total -= sizeof(struct n_tty_hist);
+		tty->history = 0;
+	}
+}
+
+/* Put c into the line at the cursor, echoing it as if it were typed. */
+static void n_tty_insert_char(struct tty_struct *tty, unsigned char c)
+{
+	unsigned int col = tty->column;
+
+	if (tty->read_cnt + tty->read_extra >= N_TTY_BUF_SIZE - 1)
+		return;
+	if (!L_ECHO(tty)) {
+		put_tty_queue(c, tty);
+		return;
+	}
+	if (tty->canon_head == tty->read_head)
+		tty->canon_column = tty->column;
+	echo_char(c, tty);
+	put_tty_width(c, echo_width(tty, col), tty);
+}
+
+/*
+ * Take the line being edited out of read_buf, leaving the cursor where
+ * it started and what it showed in the shadow for tty_type_extra().
+ */
+static void n_tty_clear_line(struct tty_struct *tty)
+{
+	int c;
+
+	finish_erasing(tty);
+	tty->read_extra = 0;
+	while ((c = unput_tty_queue(tty)) >= 0)
+		if (L_ECHO(tty))
+			tty_move_back(tty, c);
+}
+
+/* Character i of the line being edited, counting from canon_head. */
+static inline unsigned char line_char(struct tty_struct *tty, int i,
+				      int before)
+{
+	if (i < before)
+		return tty->read_buf[BUF_MASK(tty->canon_head + i)];
+	return EXTRA_CHAR(tty, i - before);
+}
+
+/*
+ * Replace the line being edited with the len characters at str and
+ * leave the cursor at its end.  Whatever the old and new lines have in
+ * common at the start is left alone.  The new middle is echoed, then
+ * the common ending once as the cursor crosses it, which also puts it
+ * in its new place if the middle changed length.  Last, the columns a
+ * shorter line no longer reaches are blanked.
+ */
+static void n_tty_replace_line(struct tty_struct *tty,
+			       const unsigned char *str, int len)
+{
+	int before = BUF_MASK(tty->read_head - tty->canon_head);
+	int old = before + tty->read_extra;
+	int pre, suf, i;
+
+	for (pre = 0; pre < old && pre < len; pre++)
+		if (line_char(tty, pre, before) != str[pre])
+			break;
+	for (suf = 0; suf < old - pre && suf < len - pre; suf++)
+		if (line_char(tty, old - 1 - suf, before) !=
+		    str[len - 1 - suf])
+			break;
+
+	finish_erasing(tty);
+	for (; before > pre; before--)
+		tty_back_char(tty);
+	for (; before < pre; before++)
+		tty_fwd_char(tty);
+	tty->read_extra -= old - suf - pre;
+	for (i = pre; i < len - suf; i++)
+		n_tty_insert_char(tty, str[i]);
+	while (tty_fwd_char(tty) >= 0)
+		;
+	tty_type_extra(tty);
+}
+
+/* Replace the line being edited with another history entry. */
+static void n_tty_hist_move(struct tty_struct *tty, int action)
+{
+	struct n_tty_hist *h = tty->history;
+	int pos, len, i;
+
+	if (!h) {
+		put_char('\a', tty);
+		return;
+	}
+	switch (action) {
+	case RL_HIST_PREV:
+		if (h->pos == h->tail) {
+			put_char('\a', tty);
+			return;
+		}
+		pos = h->pos - hist_len(h, h->pos - 2) - 4;
+		break;
+	case RL_HIST_NEXT:
+		if (h->pos == h->head) {
+			put_char('\a', tty);
+			return;
+		}
+		pos = h->pos + hist_len(h, h->pos) + 4;
+		break;
+	case RL_HIST_FIRST:
+		pos = h->tail;
+		break;
+	default:
+		pos = h->head;
+		break;
+	}
+	pos = HIST_MASK(pos);
+	if (pos == h->pos)
+		return;
+
+	/* Keep the line being typed, or don't leave it. */
+	if (h->pos == h->head) {
+		int before = BUF_MASK(tty->read_head - tty->canon_head);
+
+		len = before + tty->read_extra;
+		if (len > sizeof(h->stash)) {
+			put_char('\a', tty);
+			return;
+		}
+		for (i = 0; i < len; i++)
+			h->stash[i] = line_char(tty, i, before);
+		h->stash_len = len;
+	}
+	h->pos = pos;
+
+	n_tty_clear_line(tty);
+	if (pos != h->head) {
+		len = hist_len(h, pos);
+		for (i = 0; i < len; i++)
+			n_tty_insert_char(tty, h->buf[HIST_MASK(pos + 2 + i)]);
+	} else
+		for (i = 0; i < h->stash_len; i++)
+			n_tty_insert_char(tty, h->stash[i]);
+	tty_type_extra(tty);
+}
+
+static inline int is_word_char(unsigned char c)
+{
+	return isalnum(c) || c == '_';
+}
+
+/*
+ * Carry out a late action that only moves around in or edits the line.
+ * Returns 0 if action is something else.
+ */
+static int n_tty_edit(struct tty_struct *tty, int action)
+{
+	switch (action) {
+	case RL_ESC:
+		tty->esc = ES_ESC;
+		tty->esc_nparam = 0;
+		tty->esc_param[0] = tty->esc_param[1] = 0;
+		return 1;
+	case RL_FWD:
+		tty_fwd_char (tty);
+		return 1;
+	case RL_BACK:
+		tty_back_char (tty);
+		return 1;
+	case RL_HOME:
+		while (tty_back_char (tty) >= 0)
+			;
+		return 1;
+	case RL_END:
+		while (tty_fwd_char (tty) >= 0)
+			;
+		return 1;
+	case RL_DELETE_FWD:
+		if (tty->read_extra) {
+			tty->read_extra--;
+			tty_type_extra (tty);
+		}
+		return 1;
+	case RL_KILL_EOL:
+		tty->read_extra = 0;
+		tty_type_extra (tty);
+		return 1;
+	case RL_RUBOUT:
+		eraser (ERASE_CHAR (tty), tty);
+		return 1;
+	case RL_WORD_FWD:
+		while (tty->read_extra && !is_word_char(EXTRA_CHAR(tty, 0)))
+			tty_fwd_char (tty);
+		while (tty->read_extra && is_word_char(EXTRA_CHAR(tty, 0)))
+			tty_fwd_char (tty);
+		return 1;
+	case RL_WORD_BACK:
+		while (tty->read_head != tty->canon_head &&
+		       !is_word_char(tty->read_buf[BUF_MASK(tty->read_head - 1)]))
+			tty_back_char (tty);
+		while (tty->read_head != tty->canon_head &&
+		       is_word_char(tty->read_buf[BUF_MASK(tty->read_head - 1)]))
+			tty_back_char (tty);
+		return 1;
+	case RL_HIST_PREV:
+	case RL_HIST_NEXT:
+	case RL_HIST_FIRST:
+	case RL_HIST_LAST:
+		if (L_HISTORY(tty))
+			n_tty_hist_move(tty, action);
+		return 1;
+	}
+	return 0;
+}
+
+#define EC_CTRL		0	/* anything else */
+#define EC_DIGIT	1
+#define EC_SEMI		2
+#define EC_CSI		3	/* [ */
+#define EC_SS3		4	/* O */
+#define EC_FINAL	5	/* any other @ through ~ */
+#define EC_OTHER	6	/* any other space through ? */
+
+static const unsigned char esc_class[256] = {
+	[' ' ... '?'] = EC_OTHER,
+	['0' ... '9'] = EC_DIGIT,
+	[';'] = EC_SEMI,
+	['@' ... '~'] = EC_FINAL,
+	['['] = EC_CSI,
+	['O'] = EC_SS3,
+};
+
+static const unsigned char esc_next[4][7] = {
+	/* CTRL, DIGIT, SEMI, [, O, FINAL, OTHER */
+	[ES_NONE] = { ES_ABORT, ES_ABORT, ES_ABORT, ES_ABORT,
+		      ES_ABORT, ES_ABORT, ES_ABORT },
+	[ES_ESC] =  { ES_ABORT, ES_BAD, ES_BAD, ES_CSI,
+		      ES_SS3, ES_BAD, ES_BAD },
+	[ES_CSI] =  { ES_ABORT, ES_CSI, ES_CSI, ES_DONE,
+		      ES_DONE, ES_DONE, ES_CSI },
+	[ES_SS3] =  { ES_ABORT, ES_SS3, ES_SS3, ES_DONE,
+		      ES_DONE, ES_DONE, ES_BAD },
+};
+
+/* Look up a finished escape sequence in the keymap. */
+static int esc_key(struct tty_struct *tty, unsigned char c)
+{
+	struct tty_keymap *map = &tty->keymap->map;
+	int key;
+
+	if (c == '~')
+		return tty->esc_param[0] < sizeof(map->km_tilde) ?
+			map->km_tilde[tty->esc_param[0]] : 0;
+	key = map->km_final[(c - '@') & 63];
+	/* With ctrl held (modifier 5), the arrows move by words. */
+	if (tty->esc_param[1] && ((tty->esc_param[1] - 1) & 4)) {
+		if (key == RL_FWD)
+			key = RL_WORD_FWD;
+		else if (key == RL_BACK)
+			key = RL_WORD_BACK;
+	}
+	return key;
+}
+
+/*
+ * Run the rest of an escape sequence through the DFA in one go.
+ * Returns how many characters it took, which is 0 if the first one
+ * ends the sequence without belonging to it.
+ */
+static int n_tty_receive_esc(struct tty_struct *tty, const unsigned char *cp,
+			     char *fp, int count)
+{
+	int i, state = tty->esc, key;
+	unsigned char c;
+
+	for (i = 0; i < count; i++) {
+		c = cp[i];
+		if (fp && fp[i] != TTY_NORMAL)
+			state = ES_ABORT;
+		else
+			state = esc_next[state][esc_class[c]];
+		switch (state) {
+		case ES_CSI:
+		case ES_SS3:
+			if (esc_class[c] == EC_DIGIT) {
+				unsigned short *p =
+					&tty->esc_param[tty->esc_nparam];
+
+				if (*p < 1000)
+					*p = *p * 10 + c - '0';
+			} else if (c == ';' && tty->esc_nparam == 0)
+				tty->esc_nparam = 1;
+			break;
+		case ES_DONE:
+			tty->esc = ES_NONE;
+			key = esc_key(tty, c);
+			if (!key || !n_tty_edit(tty, key))
+				put_char('\a', tty);
+			return i + 1;
+		case ES_BAD:
+			tty->esc = ES_NONE;
+			put_char('\a', tty);
+			return i + 1;
+		case ES_ABORT:
+			tty->esc = ES_NONE;
+			return i;
+		}
+	}
+	tty->esc = state;
+	return count;
+}
+
 static inline void n_tty_receive_char(struct tty_struct *tty, unsigned char c)
 {
+	unsigned int col = tty->column;
+	unsigned char width = 0;
+	int action, late;
+
 	if (tty->raw) {
 		put_tty_queue(c, tty);
 		return;
@@ -428,12 +1433,9 @@ static inline void n_tty_receive_char(struct tty_struct *tty, unsigned char c)
 		return;
 	}
 	
-	if (I_ISTRIP(tty))
-		c &= 0x7f;
-	if (I_IUCLC(tty) && L_IEXTEN(tty))
-		c=tolower(c);
-
+	action = tty->recv_action[c];
 	if (tty->closing) {
+		c = n_tty_strip(tty, c);
 		if (I_IXON(tty)) {
 			if (c == START_CHAR(tty))
 				start_tty(tty);
@@ -442,6 +1444,7 @@ static inline void n_tty_receive_char(struct tty_struct *tty, unsigned char c)
 		}
 		return;
 	}
+	c = tty->lnext ? n_tty_strip(tty, c) : tty->recv_xlat[c];
 
 	/*
 	 * If the previous character was LNEXT, or we know that this
@@ -449,8 +1452,7 @@ static inline void n_tty_receive_char(struct tty_struct *tty, unsigned char c)
 	 * handle specially, do shortcut processing to speed things
 	 * up.
 	 */
-	if ((!test_bit(c, &tty->process_char_map) &&
-	     !tty->esc && !tty->esc_bracket) || tty->lnext) {
+	if (RECV_EARLY(action) == RA_FAST || tty->lnext) {
 		finish_erasing(tty);
 		tty->lnext = 0;
 		if (L_ECHO(tty)) {
@@ -461,205 +1463,136 @@ static inline void n_tty_receive_char(struct tty_struct *tty, unsigned char c)
 			/* Record the column of first canon char. */
 			if (tty->canon_head == tty->read_head)
 				tty->canon_column = tty->column;
+			col = tty->column;
 			echo_char(c, tty);
-			tty_type_extra(tty, 0);
+			width = echo_width(tty, col);
+			tty_type_extra(tty);
 		}
 		if (I_PARMRK(tty) && c == (unsigned char) '\377')
 			put_tty_queue(c, tty);
-		put_tty_queue(c, tty);
+		put_tty_width(c, width, tty);
 		return;
 	}
-		
-	if (c == '\r') {
-		if (I_IGNCR(tty))
-			return;
-		if (I_ICRNL(tty))
-			c = '\n';
-	} else if (c == '\n' && I_INLCR(tty))
-		c = '\r';
-	if (I_IXON(tty)) {
-		if (c == START_CHAR(tty)) {
-			start_tty(tty);
-			return;
-		}
-		if (c == STOP_CHAR(tty)) {
-			stop_tty(tty);
-			return;
-		}
-	}
-	if (L_ISIG(tty)) {
-		int signal;
-		signal = SIGINT;
-		if (c == INTR_CHAR(tty))
-			goto send_signal;
-		signal = SIGQUIT;
-		if (c == QUIT_CHAR(tty))
-			goto send_signal;
-		signal = SIGTSTP;
-		if (c == SUSP_CHAR(tty)) {
-send_signal:
-			isig(signal, tty, 0);
-			return;
-		}
-	}
-	if (L_ICANON(tty)) {
-		if (c == ERASE_CHAR(tty) || c == KILL_CHAR(tty) ||
-		    (c == WERASE_CHAR(tty) && L_IEXTEN(tty))) {
-			eraser(c, tty);
-			return;
-		}
-		if (c == LNEXT_CHAR(tty) && L_IEXTEN(tty)) {
-			tty->lnext = 1;
-			if (L_ECHO(tty)) {
-				finish_erasing(tty);
-				if (L_ECHOCTL(tty)) {
-					put_char('^', tty);
-					put_char('\b', tty);
-				}
-			}
-			return;
-		}
-		if (c == REPRINT_CHAR(tty) && L_ECHO(tty) &&
-		    L_IEXTEN(tty)) {
-			unsigned long tail = tty->canon_head;
 
+	switch (RECV_EARLY(action)) {
+	case RA_IGNORE:
+		return;
+	case RA_START:
+		start_tty(tty);
+		return;
+	case RA_STOP:
+		stop_tty(tty);
+		return;
+	case RA_INTR:
+		isig(SIGINT, tty, 0);
+		return;
+	case RA_QUIT:
+		isig(SIGQUIT, tty, 0);
+		return;
+	case RA_SUSP:
+		isig(SIGTSTP, tty, 0);
+		return;
+	case RA_SETERASE:
+		tty->termios->c_cc[VERASE] = c;
+		n_tty_set_termios(tty, 0);
+		eraser(c, tty);
+		return;
+	case RA_ERASE:
+		eraser(c, tty);
+		return;
+	case RA_LNEXT:
+		tty->lnext = 1;
+		if (L_ECHO(tty)) {
 			finish_erasing(tty);
-			echo_char(c, tty);
-			opost('\n', tty);
-			while (tail != tty->read_head) {
-				echo_char(tty->read_buf[tail], tty);
-				tail = (tail+1) & (N_TTY_BUF_SIZE-1);
+			if (L_ECHOCTL(tty)) {
+				put_char('^', tty);
+				put_char('\b', tty);
 			}
-			if (tty->read_extra)
-				tty_type_extra (tty, 0);
-			return;
 		}
-		if (1 /* L_EMACS */) {
-			if (tty->esc) {
-				tty->esc = 0;
-
-				if (c == '[' || c == 'O') {
-					tty->esc_bracket = 1;
-					return;
-				} else {
-					put_char('\a', tty);
-					return;
-				}
-			}
+		return;
+	case RA_REPRINT: {
+		unsigned long tail = tty->canon_head;
 
-			if (tty->esc_bracket) {
-				tty->esc_bracket = 0;
-
-				if (c == 'A')
-					c = CTRL('p');
-				else if (c == 'B')
-					c = CTRL('n');
-				else if (c == 'C')
-					c = CTRL('f');
-				else if (c == 'D')
-					c = CTRL('b');
-				else {
-					put_char('\a', tty);
-					return;
-				}
-			}
+		finish_erasing(tty);
+		echo_char(c, tty);
+		echo_post('\n', tty);
+		tty->shadow_end = tty->column;
+		while (tail != tty->read_head) {
+			col = tty->column;
+			echo_char(tty->read_buf[tail], tty);
+			tty->read_width[tail] = echo_width(tty, col);
+			tail = (tail+1) & (N_TTY_BUF_SIZE-1);
+		}
+		tty_type_extra (tty);
+		return;
+	}
+	}
 
-			if (c == K_ESC) {
-				tty->esc = 1;
-				return;
-			}
-			if (c == CTRL('f')) {
-				tty_fwd_char (tty);
-				return;
-			}
-			if (c == CTRL('b')) {
-				tty_back_char (tty);
-				return;
-			}
-			if (c == CTRL('a')) {
-				while (tty_back_char (tty) >= 0)
-					;
-				return;
-			}
-			if (c == CTRL('e')) {
-				while (tty_fwd_char (tty) >= 0)
-					;
-				return;
-			}
-			if (c == CTRL('d')) {
-				if (tty->read_extra) {
-					tty_fwd_char (tty);
-					eraser (ERASE_CHAR (tty), tty);
+	late = RECV_LATE(action);
+	if (late == RL_DELETE) {
+		if (tty->read_extra) {
+			tty->read_extra--;
+			tty_type_extra (tty);
+			return;
+		}
+		late = n_tty_line_action(tty, c);
+	}
 
-					return;
-				}
-			}
-			if (c == CTRL('k')) {
-				int i, todelete = tty->read_extra;
+	if (n_tty_edit(tty, late))
+		return;
 
-				for (i = 0; i < todelete; i++)
-					tty_fwd_char (tty);
-				for (i = 0; i < todelete; i++)
-					eraser (ERASE_CHAR (tty), tty);
-				return;
-			}
-			if (c == K_BS || c == K_DEL) {
-				eraser (ERASE_CHAR (tty), tty);
+	switch (late) {
+	case RL_NEWLINE:
+		if (tty->read_extra)
+			while (tty_fwd_char (tty) >= 0)
+				;
+		if (L_ECHO(tty) || L_ECHONL(tty)) {
+			if (tty->read_cnt >= N_TTY_BUF_SIZE-1) {
+				put_char('\a', tty);
 				return;
 			}
+			echo_post('\n', tty);
 		}
-		if (c == '\n') {
-			if (tty->read_extra)
-				while (tty_fwd_char (tty) >= 0)
-					;
-			if (L_ECHO(tty) || L_ECHONL(tty)) {
-				if (tty->read_cnt >= N_TTY_BUF_SIZE-1) {
-					put_char('\a', tty);
-					return;
-				}
-				opost('\n', tty);
+		goto handle_newline;
+	case RL_EOF:
+	        if (tty->canon_head != tty->read_head)
+		        set_bit(TTY_PUSH, &tty->flags);
+		c = __DISABLED_CHAR;
+		goto handle_newline;
+	case RL_EOL:
+		/*
+		 * XXX are EOL_CHAR and EOL2_CHAR echoed?!?
+		 */
+		if (L_ECHO(tty)) {
+			if (tty->read_cnt >= N_TTY_BUF_SIZE-1) {
+				put_char('\a', tty);
+				return;
 			}
-			goto handle_newline;
-		}
-		if (c == EOF_CHAR(tty)) {
-		        if (tty->canon_head != tty->read_head)
-			        set_bit(TTY_PUSH, &tty->flags);
-			c = __DISABLED_CHAR;
-			goto handle_newline;
+			/* Record the column of first canon char. */
+			if (tty->canon_head == tty->read_head)
+				tty->canon_column = tty->column;
+			echo_char(c, tty);
 		}
-		if ((c == EOL_CHAR(tty)) ||
-		    (c == EOL2_CHAR(tty) && L_IEXTEN(tty))) {
-			/*
-			 * XXX are EOL_CHAR and EOL2_CHAR echoed?!?
-			 */
-			if (L_ECHO(tty)) {
-				if (tty->read_cnt >= N_TTY_BUF_SIZE-1) {
-					put_char('\a', tty);
-					return;
-				}
-				/* Record the column of first canon char. */
-				if (tty->canon_head == tty->read_head)
-					tty->canon_column = tty->column;
-				echo_char(c, tty);
-			}
-			/*
-			 * XXX does PARMRK doubling happen for
-			 * EOL_CHAR and EOL2_CHAR?
-			 */
-			if (I_PARMRK(tty) && c == (unsigned char) '\377')
-				put_tty_queue(c, tty);
-
-		handle_newline:
-			set_bit(tty->read_head, &tty->read_flags);
+		/*
+		 * XXX does PARMRK doubling happen for
+		 * EOL_CHAR and EOL2_CHAR?
+		 */
+		if (I_PARMRK(tty) && c == (unsigned char) '\377')
 			put_tty_queue(c, tty);
-			tty->canon_head = tty->read_head;
-			tty->canon_data++;
-			if (tty->fasync)
-				kill_fasync(tty->fasync, SIGIO);
-			if (tty->read_wait)
-				wake_up_interruptible(&tty->read_wait);
-			return;
-		}
+
+	handle_newline:
+		if (L_HISTORY(tty) && L_ECHO(tty))
+			n_tty_hist_add(tty);
+		tty->shadow_end = tty->column;
+		set_bit(tty->read_head, &tty->read_flags);
+		put_tty_queue(c, tty);
+		tty->canon_head = tty->read_head;
+		tty->canon_data++;
+		if (tty->fasync)
+			kill_fasync(tty->fasync, SIGIO);
+		if (tty->read_wait)
+			wake_up_interruptible(&tty->read_wait);
+		return;
 	}
 	
 	finish_erasing(tty);
@@ -669,22 +1602,106 @@ send_signal:
 			return;
 		}
 		if (c == '\n')
-			opost('\n', tty);
+			echo_post('\n', tty);
 		else {
 			/* Record the column of first canon char. */
 			if (tty->canon_head == tty->read_head)
 				tty->canon_column = tty->column;
+			col = tty->column;
 			echo_char(c, tty);
-			tty_type_extra(tty, 0);
+			width = echo_width(tty, col);
+			tty_type_extra(tty);
 		}
 	}
 
 	if (I_PARMRK(tty) && c == (unsigned char) '\377')
 		put_tty_queue(c, tty);
 
-	put_tty_queue(c, tty);
+	put_tty_width(c, width, tty);
 }	
 
+/*
+ * Statistics for measuring the cost of redrawing: each keystroke
+ * handled while there is text after the cursor counts as one edit.
+ * TIOCGEDSTATS reads them.
+ */
+static inline void n_tty_count_edit(struct tty_struct *tty,
+				    unsigned long echoed)
+{
+	tty->edit_count++;
+	tty->edit_bytes += tty->echo_bytes - echoed;
+}
+
+/*
+ * Word-at-a-time tests for a byte below n or above n (from the usual
+ * bit-twiddling tricks; exact for 0 < n < 128).
+ */
+#define ONES			(~0UL / 255)
+#define HAS_LESS(x, n)		(((x) - ONES * (n)) & ~(x) & (ONES * 0x80))
+#define HAS_MORE(x, n)		((((x) + ONES * (127 - (n))) | (x)) & \
+				 (ONES * 0x80))
+
+/*
+ * Return the length of the leading run of printable ASCII characters
+ * that arrived without errors.
+ */
+static inline int n_tty_plain_run(const unsigned char *cp, const char *fp,
+				  int count)
+{
+	unsigned long w;
+	int n = 0;
+
+	if (!fp) {
+		while (n + (int) sizeof(w) <= count) {
+			memcpy(&w, cp + n, sizeof(w));
+			if (HAS_LESS(w, ' ') || HAS_MORE(w, '~'))
+				break;
+			n += sizeof(w);
+		}
+	}
+	while (n < count && cp[n] >= ' ' && cp[n] <= '~' &&
+	       (!fp || fp[n] == TTY_NORMAL))
+		n++;
+	return n;
+}
+
+/*
+ * Shortcut for pastes and other bulk input: none of the characters
+ * in a plain run needs any processing, so the whole run can be queued
+ * and echoed at once.  Returns the number of characters consumed, or
+ * 0 if the first one has to go through n_tty_receive_char() after all.
+ */
+static int n_tty_receive_plain(struct tty_struct *tty,
+			       const unsigned char *cp, char *fp, int count)
+{
+	int n, space;
+
+	if (tty->lnext || tty->esc || tty->closing ||
+	    (tty->stopped && I_IXON(tty) && I_IXANY(tty)))
+		return 0;
+
+	n = n_tty_plain_run(cp, fp, count);
+	space = N_TTY_BUF_SIZE - 1 - tty->read_cnt - tty->read_extra;
+	if (n > space)
+		n = space;
+	if (n <= 0)
+		return 0;
+
+	finish_erasing(tty);
+	if (L_ECHO(tty)) {
+		/* Record the column of first canon char. */
+		if (tty->canon_head == tty->read_head)
+			tty->canon_column = tty->column;
+		echo_write(cp, n, tty);
+		if (O_OPOST(tty))
+			tty->column += n;
+	}
+	put_tty_run(cp, n, L_ECHO(tty) && O_OPOST(tty), tty);
+	if (L_ECHO(tty))
+		tty_type_extra(tty);
+	return n;
+}
+
 static void n_tty_receive_buf(struct tty_struct *tty, const unsigned char *cp,
 			      char *fp, int count)
 {
@@ -710,12 +1727,51 @@ static void n_tty_receive_buf(struct tty_struct *tty, const unsigned char *cp,
 		tty->read_head = (tty->read_head + i) & (N_TTY_BUF_SIZE-1);
 		tty->read_cnt += i;
 	} else {
-		for (i=count, p = cp, f = fp; i; i--, p++) {
+		p = cp;
+		f = fp;
+		i = count;
+		while (i) {
+			if (tty->esc) {
+				int n, extra = tty->read_extra;
+				unsigned long echoed = tty->echo_bytes;
+
+				n = n_tty_receive_esc(tty, p, f, i);
+				if (n) {
+					if (extra)
+						n_tty_count_edit(tty, echoed);
+					p += n;
+					if (f)
+						f += n;
+					i -= n;
+					continue;
+				}
+			}
+			if (tty->plain_print) {
+				int n, extra = tty->read_extra;
+				unsigned long echoed = tty->echo_bytes;
+
+				n = n_tty_receive_plain(tty, p, f, i);
+				if (n) {
+					if (extra)
+						n_tty_count_edit(tty, echoed);
+					p += n;
+					if (f)
+						f += n;
+					i -= n;
+					continue;
+				}
+			}
 			if (f)
 				flags = *f++;
 			switch (flags) {
 			case TTY_NORMAL:
-				n_tty_receive_char(tty, *p);
+				if (tty->read_extra) {
+					unsigned long echoed = tty->echo_bytes;
+
+					n_tty_receive_char(tty, *p);
+					n_tty_count_edit(tty, echoed);
+				} else
+					n_tty_receive_char(tty, *p);
 				break;
 			case TTY_BREAK:
 				n_tty_receive_break(tty);
@@ -732,7 +1788,10 @@ static void n_tty_receive_buf(struct tty_struct *tty, const unsigned char *cp,
 				       flags);
 				break;
 			}
+			p++;
+			i--;
 		}
+		n_tty_flush_echo(tty);
 		if (tty->driver.flush_chars)
 			tty->driver.flush_chars(tty);
 	}
@@ -752,7 +1811,7 @@ static void n_tty_receive_buf(struct tty_struct *tty, const unsigned char *cp,
 
 static int n_tty_receive_room(struct tty_struct *tty)
 {
-	int	left = N_TTY_BUF_SIZE - tty->read_cnt - 1;
+	int	left = N_TTY_BUF_SIZE - tty->read_cnt - tty->read_extra - 1;
 
 	/*
 	 * If we are doing input canonicalization, and there are no
@@ -776,10 +1835,26 @@ int is_ignored(int sig)
 
 static void n_tty_set_termios(struct tty_struct *tty, struct termios * old)
 {
+	int c;
+
 	if (!tty)
 		return;
 	
 	tty->icanon = (L_ICANON(tty) != 0);
+	n_tty_set_opost_map(tty);
+
+	/*
+	 * Nothing outside canonical mode knows about the gap, so put
+	 * any characters after the cursor back in line before leaving.
+	 */
+	if (!tty->icanon && tty->read_extra) {
+		cli();
+		tty_close_gap(tty);
+		sti();
+	}
+	if (!tty->icanon)
+		tty->esc = ES_NONE;
+
 	if (I_ISTRIP(tty) || I_IUCLC(tty) || I_IGNCR(tty) ||
 	    I_ICRNL(tty) || I_INLCR(tty) || L_ICANON(tty) ||
 	    I_IXON(tty) || L_ISIG(tty) || L_ECHO(tty) ||
@@ -808,17 +1883,14 @@ static void n_tty_set_termios(struct tty_struct *tty, struct termios * old)
 				if (L_ECHO(tty))
 					set_bit(REPRINT_CHAR(tty),
 						&tty->process_char_map);
-
-				/* XXX check for L_EMACS */
-				set_bit(CTRL('f'), &tty->process_char_map);
-				set_bit(CTRL('b'), &tty->process_char_map);
-				set_bit(CTRL('a'), &tty->process_char_map);
-				set_bit(CTRL('e'), &tty->process_char_map);
-				set_bit(CTRL('k'), &tty->process_char_map);
-				set_bit(CTRL('d'), &tty->process_char_map);
-				set_bit(K_BS,      &tty->process_char_map);
-				set_bit(K_DEL,     &tty->process_char_map);
-				set_bit(K_ESC,     &tty->process_char_map);
+			}
+			if (L_EMACS(tty) && L_IEXTEN(tty))
+				for (c = 0; c < 256; c++)
+					if (n_tty_key_action(tty, c))
+						set_bit(c, &tty->process_char_map);
+			if (L_SETERASE(tty)) {
+				set_bit(K_BS, &tty->process_char_map);
+				set_bit(K_DEL, &tty->process_char_map);
 			}
 		}
 		if (I_IXON(tty)) {
@@ -831,10 +1903,23 @@ static void n_tty_set_termios(struct tty_struct *tty, struct termios * old)
 			set_bit(SUSP_CHAR(tty), &tty->process_char_map);
 		}
 		clear_bit(__DISABLED_CHAR, &tty->process_char_map);
+
+		/*
+		 * Runs of printable characters can bypass
+		 * n_tty_receive_char() as long as none of them is special
+		 * and neither input nor output processing changes them.
+		 */
+		tty->plain_print = !(I_IUCLC(tty) && L_IEXTEN(tty)) &&
+			!(L_ECHO(tty) && O_OPOST(tty) && O_OLCUC(tty));
+		for (c = ' '; c <= '~' && tty->plain_print; c++)
+			if (test_bit(c, &tty->process_char_map))
+				tty->plain_print = 0;
+		n_tty_set_recv_map(tty);
 		sti();
 		tty->raw = 0;
 		tty->real_raw = 0;
 	} else {
+		tty->plain_print = 0;
 		tty->raw = 1;
 		if ((I_IGNBRK(tty) || (!I_BRKINT(tty) && !I_PARMRK(tty))) &&
 		    (I_IGNPAR(tty) || !I_INPCK(tty)) &&
@@ -852,6 +1937,15 @@ static void n_tty_close(struct tty_struct *tty)
 		free_page((unsigned long) tty->read_buf);
 		tty->read_buf = 0;
 	}
+	if (tty->echo_buf) {
+		kfree_s(tty->echo_buf, N_TTY_EDIT_ALLOC);
+		tty->echo_buf = tty->shadow = tty->read_width = 0;
+	}
+	if (tty->keymap) {
+		n_tty_put_keymap(tty->keymap);
+		tty->keymap = 0;
+	}
+	n_tty_hist_free(tty);
 }
 
 static int n_tty_open(struct tty_struct *tty)
@@ -865,15 +1959,33 @@ static int n_tty_open(struct tty_struct *tty)
 		if (!tty->read_buf)
 			return -ENOMEM;
 	}
+	if (!tty->echo_buf) {
+		tty->echo_buf = (unsigned char *)
+			kmalloc(N_TTY_EDIT_ALLOC,
+				intr_count ? GFP_ATOMIC : GFP_KERNEL);
+		if (!tty->echo_buf) {
+			free_page((unsigned long) tty->read_buf);
+			tty->read_buf = 0;
+			return -ENOMEM;
+		}
+		tty->shadow = tty->echo_buf + N_TTY_ECHO_SIZE;
+		tty->read_width = tty->shadow + N_TTY_SHADOW_SIZE;
+	}
+	if (!tty->keymap) {
+		tty->keymap = &default_keymap;
+		default_keymap.count++;
+	}
+	tty->echo_cnt = 0;
 	memset(tty->read_buf, 0, N_TTY_BUF_SIZE);
 	tty->read_head = tty->read_tail = tty->read_cnt = tty->read_extra = 0;
+	tty->read_extra_end = 0;
 	tty->canon_head = tty->canon_data = tty->erasing = 0;
-	tty->column = 0;
+	tty->column = tty->shadow_end = 0;
 	memset(tty->read_flags, 0, sizeof(tty->read_flags));
 	n_tty_set_termios(tty, 0);
 	tty->minimum_to_wake = 1;
 	tty->closing = 0;
-	tty->esc = tty->esc_bracket = 0;
+	tty->esc = ES_NONE;
 	return 0;
 }
 
@@ -913,11 +2025,68 @@ static inline void copy_from_read_buf(struct tty_struct *tty,
 	*nr -= n;
 }
 
+/*
+ * Return how far past read_tail the next line delimiter is, looking at
+ * no more than n characters, or n if none of them is one.  read_flags
+ * is scanned a word at a time rather than a bit at a time.
+ */
+static inline int find_eol(struct tty_struct *tty, int n)
+{
+	unsigned int *flags = (unsigned int *) tty->read_flags;
+	unsigned int w;
+	int pos, off = 0;
+
+	while (off < n) {
+		pos = BUF_MASK(tty->read_tail + off);
+		w = flags[pos / 32] >> (pos % 32);
+		if (w) {
+			off += ffz(~w);
+			break;
+		}
+		off += 32 - pos % 32;
+	}
+	return MIN(off, n);
+}
+
+/*
+ * Canonical mode counterpart of copy_from_read_buf(): copy out the rest
+ * of the current line, at most two copies, and then the delimiter.
+ */
+static inline void copy_canon_from_read_buf(struct tty_struct *tty,
+					    unsigned char **b,
+					    unsigned int *nr)
+{
+	int	n, i, eol;
+	unsigned char c;
+
+	eol = find_eol(tty, tty->read_cnt);
+	n = MIN(*nr, eol);
+	i = MIN(n, N_TTY_BUF_SIZE - tty->read_tail);
+	memcpy_tofs(*b, &tty->read_buf[tty->read_tail], i);
+	memcpy_tofs(*b + i, tty->read_buf, n - i);
+	tty->read_tail = BUF_MASK(tty->read_tail + n);
+	tty->read_cnt -= n;
+	*b += n;
+	*nr -= n;
+	if (!tty->read_cnt || !*nr)
+		return;
+
+	clear_bit(tty->read_tail, &tty->read_flags);
+	c = tty->read_buf[tty->read_tail];
+	tty->read_tail = BUF_MASK(tty->read_tail + 1);
+	tty->read_cnt--;
+	if (--tty->canon_data < 0)
+		tty->canon_data = 0;
+	if (c != __DISABLED_CHAR) {
+		put_user(c, (*b)++);
+		(*nr)--;
+	}
+}
+
 static int read_chan(struct tty_struct *tty, struct file *file,
 		     unsigned char *buf, unsigned int nr)
 {
 	struct wait_queue wait = { current, NULL };
-	int c;
 	unsigned char *b = buf;
 	int minimum, time;
 	int retval = 0;
@@ -1019,36 +2188,9 @@ do_it_again:
 		}
 
 		if (L_ICANON(tty)) {
-			while (1) {
-				int eol;
-
-				disable_bh(TQUEUE_BH);
-				if (!tty->read_cnt) {
-					enable_bh(TQUEUE_BH);
-					break;
-				}
-				eol = clear_bit(tty->read_tail,
-						&tty->read_flags);
-				c = tty->read_buf[tty->read_tail];
-				tty->read_tail = ((tty->read_tail+1) &
-						  (N_TTY_BUF_SIZE-1));
-				tty->read_cnt--;
-				enable_bh(TQUEUE_BH);
-				if (!eol) {
-					put_user(c, b++);
-					if (--nr)
-						continue;
-					break;
-				}
-				if (--tty->canon_data < 0) {
-					tty->canon_data = 0;
-				}
-				if (c != __DISABLED_CHAR) {
-					put_user(c, b++);
-					nr--;
-				}
-				break;
-			}
+			disable_bh(TQUEUE_BH);
+			copy_canon_from_read_buf(tty, &b, &nr);
+			enable_bh(TQUEUE_BH);
 		} else {
 			disable_bh(TQUEUE_BH);
 			copy_from_read_buf(tty, &b, &nr);
@@ -1111,8 +2253,16 @@ static int write_chan(struct tty_struct * tty, struct file * file,
 			retval = -EIO;
 			break;
 		}
+		/* Keep echo in order with what the program writes. */
+		if (tty->echo_cnt)
+			n_tty_flush_echo(tty);
 		if (O_OPOST(tty)) {
 			while (nr > 0) {
+				c = opost_run(tty, b, nr);
+				if (c) {
+					b += c; nr -= c;
+					continue;
+				}
 				c = get_user(b);
 				if (opost(c, tty) < 0)
 					break;
@@ -1124,6 +2274,8 @@ static int write_chan(struct tty_struct * tty, struct file * file,
 			c = tty->driver.write(tty, 1, b, nr);
 			b += c;
 			nr -= c;
+			/* Where that left the cursor is anyone's guess. */
+			tty->shadow_end = tty->column;
 		}
 		if (!nr)
 			break;
@@ -1138,6 +2290,17 @@ static int write_chan(struct tty_struct * tty, struct file * file,
 	return (b - buf) ? b - buf : retval;
 }
 
+/*
+ * The driver has drained some output; try again with any echo that did
+ * not fit before.
+ */
+static void n_tty_write_wakeup(struct tty_struct *tty)
+{
+	n_tty_flush_echo(tty);
+	if (!tty->echo_cnt)
+		clear_bit(TTY_DO_WRITE_WAKEUP, &tty->flags);
+}
+
 static int normal_select(struct tty_struct * tty, struct inode * inode,
 			 struct file * file, int sel_type, select_table *wait)
 {
@@ -1171,6 +2334,222 @@ static int normal_select(struct tty_struct * tty, struct inode * inode,
 	return 0;
 }
 
+/*
+ * Load a keymap, sharing it with any other tty that already has the
+ * same one.
+ */
+static int n_tty_set_keymap(struct tty_struct *tty, struct tty_keymap *arg)
+{
+	struct tty_keymap *map;
+	struct n_tty_keymap *km, *old;
+	int i, retval;
+
+	retval = tty_check_change(tty);
+	if (retval)
+		return retval;
+	retval = verify_area(VERIFY_READ, arg, sizeof(*map));
+	if (retval)
+		return retval;
+	map = (struct tty_keymap *) kmalloc(sizeof(*map), GFP_KERNEL);
+	if (!map)
+		return -ENOMEM;
+	memcpy_fromfs(map, arg, sizeof(*map));
+	for (i = 0; i < sizeof(*map); i++)
+		if (((unsigned char *) map)[i] >= RL_NR_EDIT) {
+			kfree_s(map, sizeof(*map));
+			return -EINVAL;
+		}
+	km = n_tty_get_keymap(map);
+	kfree_s(map, sizeof(*map));
+	if (!km)
+		return -ENOMEM;
+
+	old = tty->keymap;
+	tty->keymap = km;
+	n_tty_set_termios(tty, 0);
+	n_tty_put_keymap(old);
+	return 0;
+}
+
+/*
+ * Only the superuser, or a reader of the tty who has it as controlling
+ * tty, may look at or change the line someone is typing.
+ */
+static int n_tty_input_access(struct tty_struct *tty, struct file *file)
+{
+	if ((file->f_mode & 1) && current->tty == tty)
+		return 0;
+	if (suser())
+		return 0;
+	return (file->f_mode & 1) ? -EACCES : -EPERM;
+}
+
+/* A hash of the line being edited, never 0. */
+static int n_tty_input_magic(struct tty_struct *tty)
+{
+	int before = BUF_MASK(tty->read_head - tty->canon_head);
+	unsigned int magic = 0;
+	int i;
+
+	for (i = 0; i < before + tty->read_extra; i++)
+		magic = magic * 3 + line_char(tty, i, before);
+	return magic ? magic : 1;
+}
+
+static void copy_ring_tofs(unsigned char *to, struct tty_struct *tty,
+			   int from, int n)
+{
+	int i = MIN(n, N_TTY_BUF_SIZE - from);
+
+	memcpy_tofs(to, tty->read_buf + from, i);
+	memcpy_tofs(to + i, tty->read_buf, n - i);
+}
+
+/*
+ * Copy out as much of the line being edited as fits.  If it doesn't all
+ * fit, ti_len is set to its length and EMSGSIZE returned.
+ */
+static int n_tty_get_input(struct tty_struct *tty, struct ttyinput *arg)
+{
+	struct ttyinput ti;
+	int before, len, n, retval;
+
+	retval = verify_area(VERIFY_WRITE, arg, sizeof(ti));
+	if (retval)
+		return retval;
+	memcpy_fromfs(&ti, arg, sizeof(ti));
+	if (ti.ti_len < 0)
+		return -EINVAL;
+	retval = verify_area(VERIFY_WRITE, ti.ti_text, ti.ti_len);
+	if (retval)
+		return retval;
+
+	disable_bh(TQUEUE_BH);
+	before = BUF_MASK(tty->read_head - tty->canon_head);
+	len = before + tty->read_extra;
+	n = MIN(ti.ti_len, len);
+	copy_ring_tofs((unsigned char *) ti.ti_text, tty, tty->canon_head,
+		       MIN(n, before));
+	if (n > before)
+		copy_ring_tofs((unsigned char *) ti.ti_text + before, tty,
+			       EXTRA_START(tty), n - before);
+	ti.ti_magic = n_tty_input_magic(tty);
+	enable_bh(TQUEUE_BH);
+
+	if (n == ti.ti_len) {
+		ti.ti_len = len;
+		retval = -EMSGSIZE;
+	} else
+		ti.ti_len = n;
+	memcpy_tofs(arg, &ti, sizeof(ti));
+	return retval;
+}
+
+/*
+ * Replace the line being edited.  If ti_magic is not 0 it must match
+ * the line as it is now, or EBUSY is returned and nothing changes.
+ */
+static int n_tty_set_input(struct tty_struct *tty, struct ttyinput *arg)
+{
+	struct ttyinput ti;
+	unsigned char *str;
+	int retval;
+
+	retval = verify_area(VERIFY_READ, arg, sizeof(ti));
+	if (retval)
+		return retval;
+	memcpy_fromfs(&ti, arg, sizeof(ti));
+	if (ti.ti_len < 0)
+		return -EINVAL;
+	if (ti.ti_len >= N_TTY_BUF_SIZE)
+		return -E2BIG;
+	retval = verify_area(VERIFY_READ, ti.ti_text, ti.ti_len);
+	if (retval)
+		return retval;
+	str = (unsigned char *) kmalloc(ti.ti_len + 1, GFP_KERNEL);
+	if (!str)
+		return -ENOMEM;
+	memcpy_fromfs(str, ti.ti_text, ti.ti_len);
+
+	disable_bh(TQUEUE_BH);
+	if (ti.ti_magic && ti.ti_magic != n_tty_input_magic(tty))
+		retval = -EBUSY;
+	else if (tty->read_cnt - BUF_MASK(tty->read_head - tty->canon_head) +
+		 ti.ti_len >= N_TTY_BUF_SIZE - 1)
+		retval = -E2BIG;
+	else
+		n_tty_replace_line(tty, str, ti.ti_len);
+	enable_bh(TQUEUE_BH);
+
+	kfree_s(str, ti.ti_len + 1);
+	n_tty_flush_echo(tty);
+	if (tty->driver.flush_chars)
+		tty->driver.flush_chars(tty);
+	return retval;
+}
+
+/*
+ * The ioctls to do with line editing are handled here; everything else
+ * goes on to n_tty_ioctl().
+ */
+static int n_tty_edit_ioctl(struct tty_struct *tty, struct file *file,
+			    unsigned int cmd, unsigned long arg)
+{
+	int retval;
+
+	switch (cmd) {
+	case TIOCGKEYMAP:
+		retval = verify_area(VERIFY_WRITE, (void *) arg,
+				     sizeof(struct tty_keymap));
+		if (retval)
+			return retval;
+		memcpy_tofs((void *) arg, &tty->keymap->map,
+			    sizeof(struct tty_keymap));
+		return 0;
+	case TIOCSKEYMAP:
+		return n_tty_set_keymap(tty, (struct tty_keymap *) arg);
+	case TIOCGEDSTATS: {
+		struct tty_edstats es;
+
+		retval = verify_area(VERIFY_WRITE, (void *) arg, sizeof(es));
+		if (retval)
+			return retval;
+		es.es_echo_bytes = tty->echo_bytes;
+		es.es_edit_count = tty->edit_count;
+		es.es_edit_bytes = tty->edit_bytes;
+		memcpy_tofs((void *) arg, &es, sizeof(es));
+		return 0;
+	}
+	case TIOCGINPUT:
+	case TIOCSINPUT:
+	case TIOCTOEOL:
+		if (!L_ICANON(tty))
+			return -EINVAL;
+		retval = n_tty_input_access(tty, file);
+		if (retval)
+			return retval;
+		if (cmd == TIOCGINPUT)
+			return n_tty_get_input(tty, (struct ttyinput *) arg);
+		if (cmd == TIOCSINPUT)
+			return n_tty_set_input(tty, (struct ttyinput *) arg);
+		disable_bh(TQUEUE_BH);
+		finish_erasing(tty);
+		while (tty_fwd_char(tty) >= 0)
+			;
+		enable_bh(TQUEUE_BH);
+		n_tty_flush_echo(tty);
+		if (tty->driver.flush_chars)
+			tty->driver.flush_chars(tty);
+		return 0;
+	case TCFLSH:
+		/* Echo still waiting for the driver is output too. */
+		if (arg == TCOFLUSH || arg == TCIOFLUSH)
+			tty->echo_cnt = 0;
+		break;
+	}
+	return n_tty_ioctl(tty, file, cmd, arg);
+}
+
 struct tty_ldisc tty_ldisc_N_TTY = {
 	TTY_LDISC_MAGIC,	/* magic */
 	0,			/* num */
@@ -1181,24 +2560,35 @@ struct tty_ldisc tty_ldisc_N_TTY = {
 	n_tty_chars_in_buffer,	/* chars_in_buffer */
 	read_chan,		/* read */
 	write_chan,		/* write */
-	n_tty_ioctl,		/* ioctl */
+	n_tty_edit_ioctl,	/* ioctl */
 	n_tty_set_termios,	/* set_termios */
 	normal_select,		/* select */
 	n_tty_receive_buf,	/* receive_buf */
 	n_tty_receive_room,	/* receive_room */
-	0			/* write_wakeup */
+	n_tty_write_wakeup	/* write_wakeup */
 };
 
 static int tty_fwd_char(struct tty_struct *tty)
 {
+	unsigned int col;
+	unsigned char c;
+
 	if (tty->read_extra == 0)
 		return -1;
-	if (L_ECHO (tty))
-		echo_char(tty->read_buf[BUF_MASK (tty->read_head)], tty);
+
+	c = EXTRA_CHAR(tty, 0);
+	tty->read_buf[tty->read_head] = c;
+	tty->read_width[tty->read_head] = 0;
+	if (L_ECHO (tty)) {
+		col = tty->column;
+		echo_char(c, tty);
+		tty->read_width[tty->read_head] = echo_width(tty, col);
+	}
 	tty->read_head = BUF_MASK (tty->read_head + 1);
 	tty->read_cnt++;
 	tty->read_extra--;
-	return tty->read_buf[BUF_MASK (tty->read_head - 1)];
+
+	return c;
 }
 
 static int tty_back_char(struct tty_struct *tty)
@@ -1210,47 +2600,74 @@ static int tty_back_char(struct tty_struct *tty)
 
 	tty->read_head = BUF_MASK (tty->read_head - 1);
 	tty->read_cnt--;
-	tty->read_extra++;
 
-	c = tty->read_buf[BUF_MASK (tty->read_head)];
+	c = tty->read_buf[tty->read_head];
 
-	if (L_ECHO (tty)) {
-		if (c == '\t') {
-			backspace_over_tab (tty);
-		} else {
-			if (iscntrl(c) && L_ECHOCTL(tty)) {
-				put_char('\b', tty);
-				if (tty->column > 0)
-					tty->column--;
-			}
-			if (!iscntrl(c) || L_ECHOCTL(tty)) {
-				put_char('\b', tty);
-				if (tty->column > 0)
-					tty->column--;
-			}
-		}
-	}
+	if (tty->read_extra++ == 0)
+		tty->read_extra_end = tty->read_tail;
+	tty->read_buf[EXTRA_START (tty)] = c;
+
+	if (L_ECHO (tty))
+		tty_move_back(tty, c);
 
 	return c;
 }
 
-static void tty_type_extra(struct tty_struct *tty, int spaces)
+/*
+ * Bring the screen after the cursor up to date with the characters
+ * after the cursor and put the cursor back.  Only the columns up to
+ * the last one that the shadow says is wrong are rewritten, so with
+ * nothing after the cursor and nothing known to need blanking, this
+ * sends nothing at all.
+ */
+static void tty_type_extra(struct tty_struct *tty)
 {
-	int n, there = tty->column;
+	unsigned char g[8];
+	unsigned int here, col, last, end;
+	int n, i, k;
 
-	if (!tty->read_extra)
+	if (!L_ECHO (tty) || (!tty->read_extra &&
+			      tty->shadow_end <= tty->column))
 		return;
 
-	if (L_ECHO (tty)) {
-		for (n = 0; n < tty->read_extra; n++)
-			echo_char(tty->read_buf[BUF_MASK(tty->read_head + n)],
-				  tty);
-		if (L_ECHOKE (tty))
-			for (n = 0; n < spaces; n++)
-				echo_char(' ', tty);
-
-		spaces = tty->column - there;
-		for (n = 0; n < spaces; n++)
-			opost('\b', tty);
+	shadow_sync(tty);
+	here = last = col = tty->column;
+
+	for (n = 0; n < tty->read_extra; n++) {
+		k = echo_glyphs(EXTRA_CHAR(tty, n), col, tty, g);
+		for (i = 0; i < k; i++, col++)
+			if (shadow_cell(tty, col) != g[i])
+				last = col + 1;
+	}
+	end = col;
+	for (; col < tty->shadow_end; col++) {
+		/*
+		 * Past the end of the line, only blank what is known to
+		 * be showing; with nothing after the cursor, the unknown
+		 * cells are most likely output that was never ours.
+		 */
+		k = shadow_cell(tty, col);
+		if (k != ' ' && (k || tty->read_extra))
+			last = col + 1;
+	}
+
+	col = here;
+	for (n = 0; col < last; n++) {
+		if (n < tty->read_extra)
+			k = echo_glyphs(EXTRA_CHAR(tty, n), col, tty, g);
+		else
+			g[0] = ' ', k = 1;
+		for (i = 0; i < k && col < last; i++, col++) {
+			put_char(O_OPOST(tty) && O_OLCUC(tty) ?
+				 toupper(g[i]) : g[i], tty);
+			shadow_set(tty, col, g[i]);
+		}
+	}
+	tty->column = col;
+	tty->shadow_end = end;
+
+	while (tty->column > here) {
+		put_char('\b', tty);
+		tty->column--;
 	}
 }
@@ -18,7 +18,9 @@
 #include <unistd.h>
 
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 
 /* list of mappings between terminal device numbers and names */
 
@@ -46,156 +48,185 @@ struct hist {
 	struct hist *next;
 };
 
+/* the device the kernel hands us requests through */
+
+#ifndef _PATH_TTYHELPER
+#define _PATH_TTYHELPER "/dev/ttyhelper"
+#endif
+
 struct ttylist *findttys();
 struct ttylist *findtty (dev_t);
 struct hist *findhist (struct hist **, pid_t, dev_t);
+void handlereq (struct ttyhelper *, struct ttylist *, struct hist **);
 void handlehist (struct ttyhelper *, struct hist *, struct ttylist *);
-void cleanup (struct hist **);
-void beep (int fd);
+void cleanup (struct hist **, struct ttyhelper *);
+void reply (int, struct ttyhelper *, char *, int);
 char **av;
 
+/* the queue shared with the kernel, mapped from _PATH_TTYHELPER */
+
+struct ttyhelperring *ring;
+
 int
 main (int argc, char **argv)
 {
+	struct ttyhelperhdr thh;
 	struct ttyhelper th;
 	struct ttylist *tl = NULL;
 	struct hist *hists = NULL;
 	time_t starttime, now;
-	int size = 1;
-	char *buf;
-	int cons;
+	u_int32_t tail;
+	fd_set fds;
+	char *cp;
+	int fd;
 
 	av = argv;
 	time (&starttime);
 
 	/*
-	 * the buffer will later be grown to be big enough for
-	 * whatever requests come in
+	 * find the device numbers of all the terminal devices,
+	 * so we can map numbers to names
+	 */
+
+	tl = findttys();
+
+	/*
+	 * the kernel's requests come through a device of their own,
+	 * which stays open for as long as we run.  only root can
+	 * open it, and only one process at a time.
 	 */
 
-	buf = malloc (size * sizeof (char));
-	if (!buf) {
-		fprintf (stderr, "%s: out of memory\n", argv[0]);
+	fd = open (_PATH_TTYHELPER, O_RDWR);
+	if (fd < 0) {
+		fprintf (stderr, "%s: %s: %s\n", argv[0], _PATH_TTYHELPER,
+			 strerror (errno));
+		if (errno == EPERM)
+			fprintf (stderr, "%s: can only usefully be "
+				 "run as root\n", argv[0]);
 		exit (EXIT_FAILURE);
 	}
 
 	/*
-	 * find the device numbers of all the terminal devices,
-	 * so we can map numbers to names
+	 * the requests are queued in a ring that we can map, and
+	 * read in place.  our replies go back in the same ring,
+	 * so handling a request takes no system calls at all.
 	 */
 
-	tl = findttys();
+	ring = (struct ttyhelperring *) mmap (NULL, sizeof (*ring),
+					      PROT_READ | PROT_WRITE,
+					      MAP_SHARED, fd, 0);
+	if (ring == (struct ttyhelperring *) -1) {
+		fprintf (stderr, "%s: mmap %s: %s\n", argv[0],
+			 _PATH_TTYHELPER, strerror (errno));
+		exit (EXIT_FAILURE);
+	}
 
 	/*
-	 * the main loop.  keep calling ioctl() to get the
-	 * next request from the terminal driver.
+	 * the main loop.  select() both waits for requests and
+	 * has the kernel carry out the replies we left last time
+	 * around; then we take every request that has queued up.
 	 */
 
 	while (1) {
-		th.th_len = size;
-		th.th_info = buf;
+		FD_ZERO (&fds);
+		FD_SET (fd, &fds);
 
-		/*
-		 * It seems silly to have to close and reopen /dev/console
-		 * every time, but otherwise, at least on the sparc, it
-		 * flakes out after logging out on the console.
-		 *
-		 * It would be better, I guess, if this were a device of
-		 * its own instead of an ioctl on an arbitrary tty.
-		 */
+		if (select (fd + 1, &fds, NULL, NULL, NULL) < 0) {
+			if (errno != EINTR) {
+				fprintf (stderr, "%s: select: %s\n",
+					 argv[0], strerror (errno));
+				sleep (1);
+			}
+			continue;
+		}
 
-		cons = open (_PATH_CONSOLE, O_RDONLY);
+		time (&now);
 
-		if (ioctl (cons, TIOCHELPER, &th) == 0) {
-			struct ttylist *t;
+		while (ring->thr_rqtail != ring->thr_rqhead) {
+			tail = ring->thr_rqtail % TH_RQ_SIZE;
+			cp = ring->thr_rq + tail;
+			memcpy (&thh, cp, sizeof (thh));
 
 			/*
-			 * discard the first few requests, because if
-			 * they've been sitting there for a while they
-			 * won't make any sense at all
+			 * the rest of the ring is unused; the next
+			 * request is at the start
 			 */
 
-			time (&now);
-			if (now <= starttime + 2)
+			if (thh.thh_request == TH_WRAP) {
+				ring->thr_rqtail += TH_RQ_SIZE - tail;
 				continue;
-
-			/*
-			 * find the name of the terminal corresponding
-			 * to this history request
-			 */
-
-			for (t = tl; t; t = t->next) {
-				if (t->dev == th.th_tty)
-					break;
 			}
 
 			/*
-			 * unless the terminal is unknown, handle
-			 * whatever request it's asking for
+			 * discard the first few requests, because if
+			 * they've been sitting there for a while they
+			 * won't make any sense at all
 			 */
 
-			if (t) {
-				struct hist *h;
+			if (now > starttime + 2) {
+				th.th_request = thh.thh_request;
+				th.th_tty = thh.thh_tty;
+				th.th_pid = thh.thh_pid;
+				th.th_step = thh.thh_step;
+				th.th_magic = thh.thh_magic;
+				th.th_len = thh.thh_len;
+				th.th_info = cp + sizeof (thh);
 
-				h = findhist (&hists, th.th_pid, th.th_tty);
-				handlehist (&th, h, t);
-				cleanup (&hists);
-			} else {
-				fprintf (stderr, "%s: unknown tty %d\n",
-					 argv[0], (int)th.th_tty);
+				handlereq (&th, tl, &hists);
 			}
-		} else {
-			if (errno == EPERM) {
-				/*
-				 * EPERM means we're not running as root
-				 */
 
-				fprintf (stderr, "%s: TIOCHELPER: %s\n",
-					 argv[0], strerror (errno));
-				fprintf (stderr, "%s: can only usefully be "
-					 "run as root\n", argv[0]);
-				exit (EXIT_FAILURE);
-			} else if (errno == E2BIG) {
-				/*
-				 * E2BIG means we need to grow the
-				 * request buffer
-				 */
-
-				free (buf);
-				size *= 2;
-
-				buf = malloc (size * sizeof (char));
-				if (!buf) {
-					fprintf (stderr, "%s: out of memory\n",
-						 argv[0]);
-					exit (EXIT_FAILURE);
-				}
-			} else {
-				/*
-				 * Some other problem; report it
-				 * and keep trying
-				 */
+			ring->thr_rqtail += TH_ALIGN (sizeof (thh) +
+						      thh.thh_len);
+		}
+	}
 
-				fprintf (stderr, "%s: ioctl: %s\n",
-					 argv[0], strerror (errno));
+	return EXIT_SUCCESS;
+}
 
-				/*
-				 * stupid workaround: if the console has
-				 * temporarily ceased to be a tty, sleep
-				 * a little to give it a chance to recover
-				 * rather than getting in a tight loop.
-				 */
+/*
+ * handlereq -- carry out one request from the terminal driver
+ */
 
-				if (errno == ENOTTY)
-					sleep (1);
-			}
+void
+handlereq (struct ttyhelper *th, struct ttylist *tl, struct hist **hists)
+{
+	struct ttylist *t;
 
-		}
+	/*
+	 * a process exiting or a terminal hanging up is news
+	 * from the kernel, not a request for history
+	 */
 
-		close (cons);
+	if (th->th_request == TH_PROC_EXIT ||
+	    th->th_request == TH_TTY_HANGUP) {
+		cleanup (hists, th);
+		return;
 	}
 
-	return EXIT_SUCCESS;
+	/*
+	 * find the name of the terminal corresponding
+	 * to this history request
+	 */
+
+	for (t = tl; t; t = t->next) {
+		if (t->dev == th->th_tty)
+			break;
+	}
+
+	/*
+	 * unless the terminal is unknown, handle
+	 * whatever request it's asking for
+	 */
+
+	if (t) {
+		struct hist *h;
+
+		h = findhist (hists, th->th_pid, th->th_tty);
+		handlehist (th, h, t);
+	} else {
+		fprintf (stderr, "%s: unknown tty %d\n",
+			 av[0], (int)th->th_tty);
+	}
 }
 
 /*
@@ -205,9 +236,7 @@ main (int argc, char **argv)
 void
 handlehist (struct ttyhelper *th, struct hist *h, struct ttylist *t)
 {
-	int fd;
-
-	fd = open (t->name, O_WRONLY);
+	int n;
 
 	switch (th->th_request) {
 	case TH_HIST_KEEP:
@@ -249,22 +278,28 @@ handlehist (struct ttyhelper *th, struct hist *h, struct ttylist *t)
 
 	case TH_HIST_PREV:
 		/*
-		 * retrieve the previous (up) history line
+		 * retrieve the previous (up) history line, or the one
+		 * th_step lines up if the kernel merged several requests
 		 */
 		if (!h->current) {
 			if (h->lines) {
 				h->current = h->lines;
+				for (n = 1; n < th->th_step && h->current->prev;
+				     n++)
+					h->current = h->current->prev;
 				goto totty;
 			} else
-				beep (fd);
+				reply (TH_REPLY_BEEP, th, NULL, 0);
 		} else {
 			if (h->current->prev) {
-				h->current = h->current->prev;
+				for (n = 0; n < th->th_step && h->current->prev;
+				     n++)
+					h->current = h->current->prev;
 				goto totty;
 			} else {
 #if 0
 				/* don't beep -- messes up the screen */
-				beep (fd);
+				reply (TH_REPLY_BEEP, th, NULL, 0);
 #endif
 				;
 			}
@@ -274,35 +309,26 @@ handlehist (struct ttyhelper *th, struct hist *h, struct ttylist *t)
 
 	case TH_HIST_NEXT:
 		/*
-		 * retrieve the next (down) history line
+		 * retrieve the next (down) history line, th_step lines
+		 * down
 		 */
 		if (!h->current)
-			beep (fd);
+			reply (TH_REPLY_BEEP, th, NULL, 0);
 		else {
-			h->current = h->current->next;
+			for (n = 0; n < th->th_step && h->current; n++)
+				h->current = h->current->next;
 totty:
-			{
-				struct ttyinput ti;
-
-				/*
-				 * now that we have the line from the history,
-				 * use ioctl() to put it in the terminal's
-				 * input buffer.
-				 */
-
-				if (h->current) {
-					ti.ti_len = strlen (h->current->text);
-					ti.ti_text = h->current->text;
-					ti.ti_magic = 0; /* XXX */
-				} else {
-					ti.ti_len = 0;
-					ti.ti_text = "";
-					ti.ti_magic = 0; /* XXX */
-				}
-
-				ioctl (fd, TIOCTOEOL);
-				ioctl (fd, TIOCSINPUT, &ti);
-			}
+			/*
+			 * now that we have the line from the history,
+			 * have the kernel put it in the terminal's
+			 * input buffer.
+			 */
+
+			if (h->current)
+				reply (TH_REPLY_INPUT, th, h->current->text,
+				       strlen (h->current->text));
+			else
+				reply (TH_REPLY_INPUT, th, "", 0);
 		}
 
 		break;
@@ -311,8 +337,6 @@ totty:
 		fprintf (stderr, "%s: unknown request %d from %s\n",
 			 av[0], th->th_request, t->name);
 	}
-
-	close (fd);
 }
 
 /*
@@ -400,45 +424,34 @@ findhist (struct hist **hists, pid_t pid, dev_t dev)
 }
 
 /*
- * cleanup -- find any history lists corresponding to processes
- * that no longer exist and get rid of them
+ * cleanup -- get rid of the history lists belonging to a process
+ * that has exited or to a terminal that has hung up, as the kernel
+ * tells us about them
  */
 
 void
-cleanup (struct hist **hpp)
+cleanup (struct hist **hpp, struct ttyhelper *th)
 {
-	/*
-	 * there must be a better way to do this than polling each
-	 * process to find out whether it's still alive.
-	 */
-
 	while (*hpp) {
-		/*
-		 * signal 0 is nondestructive, but will return
-		 * a known error if the process does not exist
-		 */
-
-		if (kill ((*hpp)->pid, 0)) {
-			if (errno == ESRCH) {
-				struct hist *tofree;
-				struct line *l;
-
-				printf ("time to clean up pid %d\n",
-					(int)((*hpp)->pid));
-
-				tofree = *hpp;
-				*hpp = (*hpp)->next;
+		if ((th->th_request == TH_PROC_EXIT &&
+		     (*hpp)->pid == th->th_pid) ||
+		    (th->th_request == TH_TTY_HANGUP &&
+		     (*hpp)->dev == th->th_tty)) {
+			struct hist *tofree;
+			struct line *l;
 
-				while (tofree->lines) {
-					l = tofree->lines;
-					tofree->lines = tofree->lines->prev;
-					free (l->text);
-					free (l);
-				}
+			tofree = *hpp;
+			*hpp = (*hpp)->next;
 
-				free (tofree);
-				continue;
+			while (tofree->lines) {
+				l = tofree->lines;
+				tofree->lines = tofree->lines->prev;
+				free (l->text);
+				free (l);
 			}
+
+			free (tofree);
+			continue;
 		}
 
 		hpp = &((*hpp)->next);
@@ -446,12 +459,48 @@ cleanup (struct hist **hpp)
 }
 
 /*
- * beep -- write a beep character to the specified file descriptor
+ * reply -- leave a reply to a request for the kernel in the ring.  it
+ * is carried out the next time we select on the helper device, but
+ * only if the line hasn't been typed on since the request: th_magic
+ * goes back with it, and the kernel checks that and replaces the
+ * line, with the cursor at the end, in one go.
  */
 
 void
-beep (int fd)
+reply (int what, struct ttyhelper *th, char *text, int len)
 {
-	write (fd, "\a", 1);
-}
+	struct ttyhelperreply thp;
+	u_int32_t head;
+	int need, pad;
+
+	need = TH_ALIGN (sizeof (thp) + len);
+	head = ring->thr_rphead % TH_RP_SIZE;
+	pad = (TH_RP_SIZE - head < need) ? TH_RP_SIZE - head : 0;
+
+	if (ring->thr_rphead - ring->thr_rptail + pad + need > TH_RP_SIZE) {
+		fprintf (stderr, "%s: too many replies queued\n", av[0]);
+		return;
+	}
 
+	/*
+	 * a reply never wraps around the end of the ring
+	 */
+
+	if (pad) {
+		thp.thp_reply = TH_WRAP;
+		memcpy (ring->thr_rp + head, &thp.thp_reply,
+			sizeof (thp.thp_reply));
+		ring->thr_rphead += pad;
+		head = 0;
+	}
+
+	thp.thp_reply = what;
+	thp.thp_tty = th->th_tty;
+	thp.thp_magic = th->th_magic;
+	thp.thp_cursor = len;
+	thp.thp_len = len;
+	memcpy (ring->thr_rp + head, &thp, sizeof (thp));
+	memcpy (ring->thr_rp + head + sizeof (thp), text, len);
+
+	ring->thr_rphead += need;
+}
@@ -0,0 +1,230 @@
+/*
+ * uparrow -- count what ttyd does for each history request
+ *
+ * Copyright 1999 Eric Fischer <enf@pobox.com>
+ *
+ * You can modify and distribute this program under the terms of the GNU
+ * General Public License.  Contact the author to arrange other licenses.
+ *
+ * usage: uparrow [-n count] ttyd-pid
+ *
+ * Types count lines on a fresh pty with L_HISTORY and L_EMACS set,
+ * then presses Up and Down count times each, waiting for the line to
+ * be redrawn after every key, while ktrace(2) watches the running
+ * ttyd.  It prints the system calls ttyd made and the bytes it moved
+ * through read() and write() per arrow key.  To compare two versions
+ * of ttyd, run each in turn and run this against it.  Must be run as
+ * root, as ttyd is.
+ *
+ * Copies the kernel makes without a system call of ttyd's, like
+ * putting the recalled line on the terminal, are not counted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <util.h>
+
+#include <sys/ioctl.h>
+#include <sys/ktrace.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#define TRACEFILE "uparrow.trace"
+
+void drain (int, int);
+void count (char *, pid_t, long *, long *);
+char **av;
+
+int
+main (int argc, char **argv)
+{
+	struct termios t;
+	int master, slave;
+	long calls, bytes;
+	pid_t ttyd, kid;
+	int i, n = 100;
+	char buf[100];
+	int c;
+
+	av = argv;
+
+	while ((c = getopt (argc, argv, "n:")) != -1) {
+		switch (c) {
+		case 'n':
+			n = atoi (optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1 || n <= 0) {
+	usage:
+		fprintf (stderr, "usage: %s [-n count] ttyd-pid\n", argv[0]);
+		exit (EXIT_FAILURE);
+	}
+	ttyd = atoi (argv[optind]);
+
+	if (openpty (&master, &slave, NULL, NULL, NULL) < 0) {
+		fprintf (stderr, "%s: openpty: %s\n", argv[0],
+			 strerror (errno));
+		exit (EXIT_FAILURE);
+	}
+
+	tcgetattr (slave, &t);
+	t.c_lflag |= ICANON | ECHO | L_HISTORY | L_EMACS;
+	tcsetattr (slave, TCSANOW, &t);
+
+	/*
+	 * the history belongs to whoever is reading the terminal,
+	 * so there has to be a process on the other side: one that
+	 * takes the pty as its controlling terminal and reads lines
+	 * until it is told to go away.
+	 */
+
+	kid = fork();
+	if (kid < 0) {
+		fprintf (stderr, "%s: fork: %s\n", argv[0],
+			 strerror (errno));
+		exit (EXIT_FAILURE);
+	}
+	if (kid == 0) {
+		close (master);
+		setsid();
+		if (ioctl (slave, TIOCSCTTY, 0) < 0)
+			_exit (EXIT_FAILURE);
+		while (read (slave, buf, sizeof (buf)) > 0)
+			;
+		_exit (EXIT_SUCCESS);
+	}
+	close (slave);
+
+	/* give ttyd something to recall */
+
+	for (i = 0; i < n; i++) {
+		sprintf (buf, "line %d\n", i);
+		write (master, buf, strlen (buf));
+		drain (master, 0);
+	}
+
+	unlink (TRACEFILE);
+	close (open (TRACEFILE, O_WRONLY | O_CREAT, 0600));
+	if (ktrace (TRACEFILE, KTROP_SET, KTRFAC_SYSCALL | KTRFAC_GENIO,
+		    ttyd) < 0) {
+		fprintf (stderr, "%s: ktrace %d: %s\n", argv[0], ttyd,
+			 strerror (errno));
+		kill (kid, SIGKILL);
+		exit (EXIT_FAILURE);
+	}
+
+	/*
+	 * one key at a time, and wait to see its effect, so that
+	 * none of them are merged into one request in the queue.
+	 */
+
+	for (i = 0; i < n; i++) {
+		write (master, "\033[A", 3);
+		drain (master, 1);
+	}
+	for (i = 0; i < n; i++) {
+		write (master, "\033[B", 3);
+		drain (master, 1);
+	}
+
+	ktrace (TRACEFILE, KTROP_CLEAR, KTRFAC_SYSCALL | KTRFAC_GENIO, ttyd);
+
+	write (master, "\025\004", 2);		/* ^U ^D */
+	kill (kid, SIGHUP);
+	waitpid (kid, NULL, 0);
+
+	count (TRACEFILE, ttyd, &calls, &bytes);
+	printf ("%d arrow keys: %ld system calls, %.2f per key\n",
+		2 * n, calls, (double) calls / (2 * n));
+	printf ("%d arrow keys: %ld bytes read or written, %.1f per key\n",
+		2 * n, bytes, (double) bytes / (2 * n));
+
+	unlink (TRACEFILE);
+	exit (EXIT_SUCCESS);
+}
+
+/*
+ * read what the terminal echoes.  if the caller is waiting for a
+ * redraw, wait up to a second for it to start; then take whatever
+ * else comes without a pause.
+ */
+
+void
+drain (int fd, int wait)
+{
+	struct timeval tv;
+	fd_set fds;
+	char buf[100];
+
+	tv.tv_sec = wait;
+	tv.tv_usec = 0;
+
+	while (1) {
+		FD_ZERO (&fds);
+		FD_SET (fd, &fds);
+
+		if (select (fd + 1, &fds, NULL, NULL, &tv) <= 0)
+			break;
+		if (read (fd, buf, sizeof (buf)) <= 0)
+			break;
+
+		tv.tv_sec = 0;
+		tv.tv_usec = 50000;
+	}
+}
+
+/*
+ * add up the system calls and the read/write data in a trace file.
+ * each record is a header and ktr_len bytes of its own.
+ */
+
+void
+count (char *file, pid_t pid, long *calls, long *bytes)
+{
+	struct ktr_header kth;
+	char *buf = NULL;
+	int size = 0;
+	FILE *f;
+
+	*calls = *bytes = 0;
+
+	f = fopen (file, "r");
+	if (f == NULL) {
+		fprintf (stderr, "%s: %s: %s\n", av[0], file,
+			 strerror (errno));
+		exit (EXIT_FAILURE);
+	}
+
+	while (fread (&kth, sizeof (kth), 1, f) == 1) {
+		if (kth.ktr_len > size) {
+			size = kth.ktr_len;
+			buf = realloc (buf, size);
+			if (buf == NULL) {
+				fprintf (stderr, "%s: out of memory\n", av[0]);
+				exit (EXIT_FAILURE);
+			}
+		}
+		if (kth.ktr_len > 0 && fread (buf, kth.ktr_len, 1, f) != 1)
+			break;
+		if (kth.ktr_pid != pid)
+			continue;
+
+		if (kth.ktr_type == KTR_SYSCALL)
+			(*calls)++;
+		else if (kth.ktr_type == KTR_GENIO)
+			*bytes += kth.ktr_len - sizeof (struct ktr_genio);
+	}
+
+	fclose (f);
+	free (buf);
+}